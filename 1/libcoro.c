@@ -1,205 +1,287 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <setjmp.h>
 #include <signal.h>
 #include <errno.h>
 #include <string.h>
+#include <time.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <execinfo.h>
+#include <linux/io_uring.h>
+#include <pthread.h>
+#if defined(__x86_64__)
+#include <x86intrin.h>
+#endif
 #include "libcoro.h"
 
 #define handle_error() ({printf("Error %s\n", strerror(errno)); exit(-1);})
 
-/** Main coroutine structure, its context. */
-struct coro {
-	/** A value, returned by func. */
-	int ret;
-	/** Stack, used by the coroutine. */
-	void *stack;
-	/** An argument for the function func. */
-	void *func_arg;
-	/** A function to call as a coroutine. */
-	coro_f func;
-	/** Last remembered coroutine context. */
-	sigjmp_buf ctx;
-	/** True, if the coroutine has finished. */
-	bool is_finished;
-	long long switch_count;
-	/** Links in the coroutine list, used by scheduler. */
-	struct coro *next, *prev;
-};
-
 /**
- * Scheduler is a main coroutine - it catches and returns dead
- * ones to a user.
+ * Context switch engine. A context is everything needed to
+ * resume an execution flow: its stack and the registers which
+ * the calling convention obliges a callee to preserve. The
+ * caller-saved registers are spilled by the compiler before a
+ * call to coro_ctx_switch() anyway, so they are not touched.
+ *
+ * On x86-64 and aarch64 the switch is a few instructions of
+ * assembly and creation is just a preparation of a fake frame
+ * on the new stack. Other architectures use the portable, but
+ * much slower sigaltstack() + sigsetjmp() way. It can be forced
+ * with LIBCORO_USE_SIGALTSTACK macro.
  */
-static struct coro coro_sched;
+#if ! defined(LIBCORO_USE_SIGALTSTACK) && \
+    (defined(__x86_64__) || defined(__aarch64__))
+#define CORO_CTX_ASM 1
+#else
+#define CORO_CTX_ASM 0
+#endif
+
+typedef void (*coro_ctx_f)(void *);
+
+struct coro_ctx {
+#if CORO_CTX_ASM
+	/**
+	 * Stack pointer of a suspended context. The callee-saved
+	 * registers and the return address are stored right on
+	 * that stack.
+	 */
+	void *sp;
+#else
+	/** Registers of a suspended context. */
+	sigjmp_buf buf;
+#endif
+};
+
+#if CORO_CTX_ASM
+
 /**
- * True, if in that moment the scheduler is waiting for a
- * coroutine finish.
+ * Save the callee-saved registers on the current stack, store
+ * the stack pointer into @a from_sp, load @a to_sp and restore
+ * the registers from there.
  */
-static bool is_sched_waiting = false;
-/** Which coroutine works at this moment. */
-static struct coro *coro_this_ptr = NULL;
-/** List of all the coroutines. */
-static struct coro *coro_list = NULL;
+void
+coro_ctx_switch_asm(void **from_sp, void *to_sp);
+
 /**
- * Buffer, used by the coroutine constructor to escape from the
- * signal handler back into the constructor to rollback
- * sigaltstack etc.
+ * The first code executed by a new context. It calls a function
+ * and its argument, put into the fake frame by coro_ctx_create().
  */
-static sigjmp_buf start_point;
+void
+coro_ctx_entry_asm(void);
 
-/** Add a new coroutine to the beginning of the list. */
-static void
-coro_list_add(struct coro *c)
-{
-	c->next = coro_list;
-	c->prev = NULL;
-	if (coro_list != NULL)
-		coro_list->prev = c;
-	coro_list = c;
-}
+#if defined(__x86_64__)
 
-/** Remove a coroutine from the list. */
-static void
-coro_list_delete(struct coro *c)
-{
-	struct coro *prev = c->prev, *next = c->next;
-	if (prev != NULL)
-		prev->next = next;
-	if (next != NULL)
-		next->prev = prev;
-	if (prev == NULL)
-		coro_list = next;
-}
+/*
+ * Callee-saved: rbx, rbp, r12-r15, MXCSR and x87 control words.
+ * The frame layout from the stack pointer upwards is: control
+ * words, r15, r14, r13, r12, rbx, rbp, return address.
+ */
+__asm__(
+	".text\n"
+	".p2align 4\n"
+	".type coro_ctx_switch_asm, @function\n"
+	"coro_ctx_switch_asm:\n"
+	"	pushq %rbp\n"
+	"	pushq %rbx\n"
+	"	pushq %r12\n"
+	"	pushq %r13\n"
+	"	pushq %r14\n"
+	"	pushq %r15\n"
+	"	subq $8, %rsp\n"
+	"	stmxcsr (%rsp)\n"
+	"	fnstcw 4(%rsp)\n"
+	"	movq %rsp, (%rdi)\n"
+	"	movq %rsi, %rsp\n"
+	"	ldmxcsr (%rsp)\n"
+	"	fldcw 4(%rsp)\n"
+	"	addq $8, %rsp\n"
+	"	popq %r15\n"
+	"	popq %r14\n"
+	"	popq %r13\n"
+	"	popq %r12\n"
+	"	popq %rbx\n"
+	"	popq %rbp\n"
+	"	ret\n"
+	".size coro_ctx_switch_asm, .-coro_ctx_switch_asm\n"
+	"\n"
+	".p2align 4\n"
+	".type coro_ctx_entry_asm, @function\n"
+	"coro_ctx_entry_asm:\n"
+	"	movq %r13, %rdi\n"
+	"	callq *%r12\n"
+	"	ud2\n"
+	".size coro_ctx_entry_asm, .-coro_ctx_entry_asm\n"
+);
 
-int
-coro_status(const struct coro *c)
-{
-	return c->ret;
-}
+enum {
+	CORO_CTX_FRAME_WORDS = 8,
+	CORO_CTX_FRAME_ARG = 3,
+	CORO_CTX_FRAME_FUNC = 4,
+	CORO_CTX_FRAME_RET = 7,
+};
 
-long long
-coro_switch_count(const struct coro *c)
-{
-	return c->switch_count;
-}
+#elif defined(__aarch64__)
 
-bool
-coro_is_finished(const struct coro *c)
-{
-	return c->is_finished;
-}
+/*
+ * Callee-saved: x19-x28, frame pointer x29, link register x30
+ * and the low halves of v8-v15. The frame layout from the stack
+ * pointer upwards is: x19, x20, ..., x30, d8, ..., d15.
+ */
+__asm__(
+	".text\n"
+	".p2align 4\n"
+	".type coro_ctx_switch_asm, %function\n"
+	"coro_ctx_switch_asm:\n"
+	"	sub sp, sp, #160\n"
+	"	stp x19, x20, [sp, #0]\n"
+	"	stp x21, x22, [sp, #16]\n"
+	"	stp x23, x24, [sp, #32]\n"
+	"	stp x25, x26, [sp, #48]\n"
+	"	stp x27, x28, [sp, #64]\n"
+	"	stp x29, x30, [sp, #80]\n"
+	"	stp d8, d9, [sp, #96]\n"
+	"	stp d10, d11, [sp, #112]\n"
+	"	stp d12, d13, [sp, #128]\n"
+	"	stp d14, d15, [sp, #144]\n"
+	"	mov x9, sp\n"
+	"	str x9, [x0]\n"
+	"	mov sp, x1\n"
+	"	ldp x19, x20, [sp, #0]\n"
+	"	ldp x21, x22, [sp, #16]\n"
+	"	ldp x23, x24, [sp, #32]\n"
+	"	ldp x25, x26, [sp, #48]\n"
+	"	ldp x27, x28, [sp, #64]\n"
+	"	ldp x29, x30, [sp, #80]\n"
+	"	ldp d8, d9, [sp, #96]\n"
+	"	ldp d10, d11, [sp, #112]\n"
+	"	ldp d12, d13, [sp, #128]\n"
+	"	ldp d14, d15, [sp, #144]\n"
+	"	add sp, sp, #160\n"
+	"	ret\n"
+	".size coro_ctx_switch_asm, .-coro_ctx_switch_asm\n"
+	"\n"
+	".p2align 4\n"
+	".type coro_ctx_entry_asm, %function\n"
+	"coro_ctx_entry_asm:\n"
+	"	mov x0, x20\n"
+	"	blr x19\n"
+	"	brk #0\n"
+	".size coro_ctx_entry_asm, .-coro_ctx_entry_asm\n"
+);
 
-void
-coro_delete(struct coro *c)
-{
-	free(c->stack);
-	free(c);
-}
+enum {
+	CORO_CTX_FRAME_WORDS = 20,
+	CORO_CTX_FRAME_FUNC = 0,
+	CORO_CTX_FRAME_ARG = 1,
+	CORO_CTX_FRAME_RET = 11,
+};
 
-/** Switch the current coroutine to an arbitrary one. */
-static void
-coro_yield_to(struct coro *to)
-{
-	struct coro *from = coro_this_ptr;
-	++from->switch_count;
-	if (sigsetjmp(from->ctx, 0) == 0)
-		siglongjmp(to->ctx, 1);
-	coro_this_ptr = from;
-}
+#endif
 
-void
-coro_yield(void)
+/**
+ * Prepare a context which on the first switch to it calls
+ * @a f(@a arg) on the given stack. @a f must never return.
+ */
+static void
+coro_ctx_create(struct coro_ctx *ctx, void *stack, size_t stack_size,
+		coro_ctx_f f, void *arg)
 {
-	struct coro *from = coro_this_ptr;
-	struct coro *to = from->next;
-	if (to == NULL)
-		coro_yield_to(&coro_sched);
-	else
-		coro_yield_to(to);
+	uintptr_t top = ((uintptr_t)stack + stack_size) & ~(uintptr_t)15;
+	/*
+	 * 16 bytes of padding on top is a zero return address of
+	 * the entry function, to stop stack unwinders. The frame
+	 * size is a multiple of 16, so the stack is aligned as
+	 * the ABI demands when the entry function calls @a f.
+	 */
+	uint64_t *frame = (uint64_t *)(top - 16) - CORO_CTX_FRAME_WORDS;
+	memset(frame, 0, (CORO_CTX_FRAME_WORDS + 2) * sizeof(uint64_t));
+#if defined(__x86_64__)
+	/* Default MXCSR and x87 control word. */
+	frame[0] = 0x1F80 | ((uint64_t)0x037F << 32);
+#endif
+	frame[CORO_CTX_FRAME_FUNC] = (uintptr_t)f;
+	frame[CORO_CTX_FRAME_ARG] = (uintptr_t)arg;
+	frame[CORO_CTX_FRAME_RET] = (uintptr_t)coro_ctx_entry_asm;
+	ctx->sp = frame;
 }
 
-void
-coro_sched_init(void)
+static inline void
+coro_ctx_switch(struct coro_ctx *from, struct coro_ctx *to)
 {
-	memset(&coro_sched, 0, sizeof(coro_sched));
-	coro_this_ptr = &coro_sched;
+	/*
+	 * The target stack pointer is read before the current one
+	 * is saved, so a switch to self would load a stale one.
+	 */
+	if (from == to)
+		return;
+	coro_ctx_switch_asm(&from->sp, to->sp);
 }
 
-struct coro *
-coro_sched_wait(void)
-{
-	while (coro_list != NULL) {
-		for (struct coro *c = coro_list; c != NULL; c = c->next) {
-			if (c->is_finished) {
-				coro_list_delete(c);
-				return c;
-			}
-		}
-		is_sched_waiting = true;
-		coro_yield_to(coro_list);
-		is_sched_waiting = false;
-	}
-	return NULL;
-}
+#else /* ! CORO_CTX_ASM */
 
-struct coro *
-coro_this(void)
-{
-	return coro_this_ptr;
-}
+/**
+ * Buffer, used by the context constructor to escape from the
+ * signal handler back into the constructor to rollback
+ * sigaltstack etc.
+ */
+static sigjmp_buf start_point;
+/** The context being created and what it should call. */
+static struct coro_ctx *volatile ctx_new = NULL;
+static coro_ctx_f ctx_new_f;
+static void *ctx_new_arg;
+/** The above are global, so the creation is serialized. */
+static pthread_mutex_t ctx_new_lock = PTHREAD_MUTEX_INITIALIZER;
 
 /**
- * The core part of the coroutines creation - this signal handler
+ * The core part of the context creation - this signal handler
  * is run on a separate stack using sigaltstack. On an invokation
  * it remembers its current context and jumps back to the
- * coroutine constructor. Later the coroutine continues from here.
+ * context constructor. Later the context continues from here.
  */
 static void
-coro_body(int signum)
+coro_ctx_trampoline(int signum)
 {
 	(void)signum;
-	struct coro *c = coro_this_ptr;
-	coro_this_ptr = NULL;
+	struct coro_ctx *ctx = ctx_new;
+	coro_ctx_f f = ctx_new_f;
+	void *arg = ctx_new_arg;
+	ctx_new = NULL;
 	/*
 	 * On an invokation jump back to the constructor right
 	 * after remembering the context.
 	 */
-	if (sigsetjmp(c->ctx, 0) == 0)
+	if (sigsetjmp(ctx->buf, 0) == 0)
 		siglongjmp(start_point, 1);
 	/*
-	 * If the execution is here, then the coroutine should
+	 * If the execution is here, then the context should
 	 * finaly start work.
 	 */
-	coro_this_ptr = c;
-	c->ret = c->func(c->func_arg);
-	c->is_finished = true;
+	f(arg);
 	/* Can not return - 'ret' address is invalid already! */
-	if (! is_sched_waiting) {
-		printf("Critical error - no place to return!\n");
-		exit(-1);
-	}
-	siglongjmp(coro_sched.ctx, 1);
+	abort();
 }
 
-struct coro *
-coro_new(coro_f func, void *func_arg)
+static void
+coro_ctx_create(struct coro_ctx *ctx, void *stack, size_t stack_size,
+		coro_ctx_f f, void *arg)
 {
-	struct coro *c = (struct coro *) malloc(sizeof(*c));
-	c->ret = 0;
-	int stack_size = 1024 * 1024;
-	if (stack_size < SIGSTKSZ)
-		stack_size = SIGSTKSZ;
-	c->stack = malloc(stack_size);
-	c->func = func;
-	c->func_arg = func_arg;
-	c->is_finished = false;
-	c->switch_count = 0;
 	/*
 	 * SIGUSR2 is used. First of all, block new signals to be
 	 * able to set a new handler.
 	 */
+	pthread_mutex_lock(&ctx_new_lock);
 	sigset_t news, olds, suss;
 	sigemptyset(&news);
 	sigaddset(&news, SIGUSR2);
@@ -208,35 +290,35 @@ coro_new(coro_f func, void *func_arg)
 	/*
 	 * New handler should jump onto a new stack and remember
 	 * that position. Afterwards the stack is disabled and
-	 * becomes dedicated to that single coroutine.
+	 * becomes dedicated to that single context.
 	 */
 	struct sigaction newsa, oldsa;
-	newsa.sa_handler = coro_body;
+	newsa.sa_handler = coro_ctx_trampoline;
 	newsa.sa_flags = SA_ONSTACK;
 	sigemptyset(&newsa.sa_mask);
 	if (sigaction(SIGUSR2, &newsa, &oldsa) != 0)
 		handle_error();
 	/* Create that new stack. */
 	stack_t oldst, newst;
-	newst.ss_sp = c->stack;
+	newst.ss_sp = stack;
 	newst.ss_size = stack_size;
 	newst.ss_flags = 0;
 	if (sigaltstack(&newst, &oldst) != 0)
 		handle_error();
 	/* Jump onto the stack and remember its position. */
-	struct coro *old_this = coro_this_ptr;
-	coro_this_ptr = c;
+	ctx_new_f = f;
+	ctx_new_arg = arg;
+	ctx_new = ctx;
 	sigemptyset(&suss);
 	if (sigsetjmp(start_point, 1) == 0) {
 		raise(SIGUSR2);
-		while (coro_this_ptr != NULL)
+		while (ctx_new != NULL)
 			sigsuspend(&suss);
 	}
-	coro_this_ptr = old_this;
 	/*
 	 * Return the old stack, unblock SIGUSR2. In other words,
 	 * rollback all global changes. The newly created stack
-	 * now is remembered only by the new coroutine, and can be
+	 * now is remembered only by the new context, and can be
 	 * used by it only.
 	 */
 	if (sigaltstack(NULL, &newst) != 0)
@@ -251,8 +333,4100 @@ coro_new(coro_f func, void *func_arg)
 		handle_error();
 	if (sigprocmask(SIG_SETMASK, &olds, NULL) != 0)
 		handle_error();
+	pthread_mutex_unlock(&ctx_new_lock);
+}
 
-	/* Now scheduler can work with that coroutine. */
-	coro_list_add(c);
+static inline void
+coro_ctx_switch(struct coro_ctx *from, struct coro_ctx *to)
+{
+	if (sigsetjmp(from->buf, 0) == 0)
+		siglongjmp(to->buf, 1);
+}
+
+#endif /* ! CORO_CTX_ASM */
+
+#define rlist_entry(item, type, member)					\
+	((type *)((char *)(item) - offsetof(type, member)))
+
+#define rlist_first_entry(head, type, member)				\
+	rlist_entry((head)->next, type, member)
+
+static inline void
+rlist_create(struct rlist *list)
+{
+	list->next = list;
+	list->prev = list;
+}
+
+static inline bool
+rlist_empty(const struct rlist *list)
+{
+	return list->next == list;
+}
+
+static inline void
+rlist_add_tail(struct rlist *head, struct rlist *item)
+{
+	item->prev = head->prev;
+	item->next = head;
+	head->prev->next = item;
+	head->prev = item;
+}
+
+static inline void
+rlist_del(struct rlist *item)
+{
+	item->prev->next = item->next;
+	item->next->prev = item->prev;
+	rlist_create(item);
+}
+
+/** Remove the first item of a non-empty list. */
+static inline struct rlist *
+rlist_shift(struct rlist *head)
+{
+	struct rlist *item = head->next;
+	rlist_del(item);
+	return item;
+}
+
+#define rlist_shift_entry(head, type, member)				\
+	rlist_entry(rlist_shift(head), type, member)
+
+enum {
+	/** Size of the smallest stack size class. */
+	CORO_STACK_CLASS_MIN_SIZE = 16 * 1024,
+	/**
+	 * Number of stack size classes. Each class is twice
+	 * bigger than the previous one. Bigger stacks are not
+	 * pooled.
+	 */
+	CORO_STACK_CLASS_COUNT = 16,
+	/** How much memory the pool keeps by default. */
+	CORO_STACK_POOL_MAX_SIZE_DEFAULT = 64 * 1024 * 1024,
+	/** Stack size of a coroutine if not specified. */
+	CORO_STACK_SIZE_DEFAULT = 1024 * 1024,
+	/** Size of the stack, shared by coroutines of a scheduler. */
+	CORO_SHARED_STACK_SIZE = CORO_STACK_SIZE_DEFAULT,
+	/** Stack of the context which copies the shared stack. */
+	CORO_SHARED_COPIER_STACK_SIZE = CORO_STACK_CLASS_MIN_SIZE,
+};
+
+#ifndef MADV_GUARD_INSTALL
+#define MADV_GUARD_INSTALL 102
+#endif
+
+/** Cached system page size. */
+static size_t page_size = 0;
+
+static size_t
+coro_page_size(void)
+{
+	if (page_size == 0)
+		page_size = sysconf(_SC_PAGESIZE);
+	return page_size;
+}
+
+/**
+ * Map a new stack. The memory is not reserved, so only the
+ * touched pages consume physical memory. Below the stack there
+ * is a guard page, so an overflow crashes right away instead of
+ * corrupting whatever is next in memory.
+ */
+static void *
+coro_stack_new(size_t size)
+{
+	size_t guard = coro_page_size();
+	char *base = mmap(NULL, size + guard, PROT_READ | PROT_WRITE,
+			  MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE |
+			  MAP_STACK, -1, 0);
+	if (base == MAP_FAILED)
+		handle_error();
+	/*
+	 * A guard installed by madvise() does not split the
+	 * mapping, unlike mprotect(). Otherwise each stack would
+	 * cost 2 mappings, and vm.max_map_count would be hit by
+	 * just ~32k coroutines. Old kernels do not support that.
+	 */
+	if (madvise(base, guard, MADV_GUARD_INSTALL) != 0 &&
+	    mprotect(base, guard, PROT_NONE) != 0)
+		handle_error();
+	return base + guard;
+}
+
+static void
+coro_stack_delete(void *stack, size_t size)
+{
+	size_t guard = coro_page_size();
+	if (munmap((char *)stack - guard, size + guard) != 0)
+		handle_error();
+}
+
+/**
+ * A free stack in the pool. It is stored right in the stack
+ * memory, on its top. That page was surely touched by the
+ * previous owner, so storing it does not fault in a new page.
+ */
+struct coro_stack_free {
+	/** The stack itself. */
+	void *stack;
+	struct coro_stack_free *next;
+};
+
+/**
+ * Pool of the stacks of the deleted coroutines. Creation of a
+ * new coroutine takes a stack from here, if there is one of the
+ * needed size class, and thus does not touch the kernel nor
+ * fault in new pages.
+ */
+struct coro_stack_pool {
+	/** Free stacks of each size class. */
+	struct coro_stack_free *classes[CORO_STACK_CLASS_COUNT];
+	/** Total size of the stacks in the pool. */
+	size_t size;
+	/** The pool does not keep more memory than that. */
+	size_t max_size;
+	/** Stacks taken from the pool. */
+	long long hits;
+	/** Stacks which had to be allocated. */
+	long long misses;
+};
+
+/**
+ * Size class of a stack of the given size. CORO_STACK_CLASS_COUNT
+ * if the stack is too big for the pool.
+ */
+static int
+coro_stack_class(size_t size)
+{
+	int cls = 0;
+	size_t cls_size = CORO_STACK_CLASS_MIN_SIZE;
+	while (cls_size < size && cls < CORO_STACK_CLASS_COUNT) {
+		cls_size *= 2;
+		++cls;
+	}
+	return cls;
+}
+
+/**
+ * Take a stack of at least @a size bytes from the pool, or
+ * allocate a new one. The real size is returned in @a real_size.
+ */
+static void *
+coro_stack_pool_get(struct coro_stack_pool *pool, size_t size,
+		    size_t *real_size)
+{
+	int cls = coro_stack_class(size);
+	if (cls < CORO_STACK_CLASS_COUNT) {
+		size = (size_t)CORO_STACK_CLASS_MIN_SIZE << cls;
+		struct coro_stack_free *s = pool->classes[cls];
+		if (s != NULL) {
+			pool->classes[cls] = s->next;
+			pool->size -= size;
+			++pool->hits;
+			*real_size = size;
+			return s->stack;
+		}
+	} else {
+		size_t mask = coro_page_size() - 1;
+		size = (size + mask) & ~mask;
+	}
+	++pool->misses;
+	*real_size = size;
+	return coro_stack_new(size);
+}
+
+/** Return a stack into the pool, or free it if the pool is full. */
+static void
+coro_stack_pool_put(struct coro_stack_pool *pool, void *stack, size_t size)
+{
+	int cls = coro_stack_class(size);
+	if (cls == CORO_STACK_CLASS_COUNT ||
+	    pool->size + size > pool->max_size) {
+		coro_stack_delete(stack, size);
+		return;
+	}
+	struct coro_stack_free *s =
+		(struct coro_stack_free *)((char *)stack + size) - 1;
+	s->stack = stack;
+	s->next = pool->classes[cls];
+	pool->classes[cls] = s;
+	pool->size += size;
+}
+
+/** Free the stacks of the pool until it fits into @a max_size. */
+static void
+coro_stack_pool_trim(struct coro_stack_pool *pool, size_t max_size)
+{
+	for (int cls = CORO_STACK_CLASS_COUNT - 1; cls >= 0; --cls) {
+		size_t size = (size_t)CORO_STACK_CLASS_MIN_SIZE << cls;
+		while (pool->size > max_size && pool->classes[cls] != NULL) {
+			struct coro_stack_free *s = pool->classes[cls];
+			pool->classes[cls] = s->next;
+			pool->size -= size;
+			coro_stack_delete(s->stack, size);
+		}
+	}
+}
+
+/** A pattern which is unlikely to be found in a used stack. */
+static const uint64_t coro_stack_canary = 0xc0dec0dec0dec0deULL;
+
+/** Fill the stack with the canary, to measure its usage later. */
+static void
+coro_stack_fill(void *stack, size_t size)
+{
+	uint64_t *words = stack;
+	for (size_t i = 0; i < size / sizeof(*words); ++i)
+		words[i] = coro_stack_canary;
+}
+
+/**
+ * Find how deep the stack was used. It grows down, so the canary
+ * is intact from the bottom up to the deepest touched word.
+ */
+static size_t
+coro_stack_measure(const void *stack, size_t size)
+{
+	const uint64_t *words = stack;
+	size_t count = size / sizeof(*words);
+	size_t i = 0;
+	while (i < count && words[i] == coro_stack_canary)
+		++i;
+	return (count - i) * sizeof(*words);
+}
+
+enum coro_state {
+	/** In a ready queue, waits for its turn to run. */
+	CORO_STATE_READY,
+	/** Works right now. */
+	CORO_STATE_RUNNING,
+	/** In a blocked set, until somebody wakes it up. */
+	CORO_STATE_SUSPENDED,
+	/** Function has returned. */
+	CORO_STATE_FINISHED,
+};
+
+/** Main coroutine structure, its context. */
+struct coro {
+	/** A value, returned by func. */
+	int ret;
+	/** Stack, used by the coroutine. */
+	void *stack;
+	/** Size of the stack, a size class of the stack pool. */
+	size_t stack_size;
+	/** True, if the stack was filled with the canary. */
+	bool is_stack_measured;
+	/**
+	 * True, if the coroutine runs on the shared stack of the
+	 * scheduler, and has no own one.
+	 */
+	bool is_stack_shared;
+	/**
+	 * Used part of the shared stack, saved when another
+	 * coroutine took the stack.
+	 */
+	char *stack_copy;
+	size_t stack_copy_size;
+	size_t stack_copy_capacity;
+	/** An argument for the function func. */
+	void *func_arg;
+	/** A function to call as a coroutine. */
+	coro_f func;
+	/** Last remembered coroutine context. */
+	struct coro_ctx ctx;
+	/** What the coroutine is doing now. */
+	enum coro_state state;
+	/**
+	 * True, if the coroutine was woken up when it was not
+	 * suspended. Then its next suspension ends immediately.
+	 */
+	bool is_wakeup_pending;
+	long long switch_count;
+	/**
+	 * Link in one of the scheduler queues: ready, blocked or
+	 * finished. The running coroutine is not in any.
+	 */
+	struct rlist in_sched;
+	/** Link in a wait queue the coroutine is suspended on. */
+	struct rlist in_wait;
+	/** Link in the list of all coroutines, for the dump. */
+	struct rlist in_all;
+	/** Name for the diagnostics, empty if not set. */
+	char name[CORO_NAME_MAX];
+	/** When to wake the coroutine up, if it is in the timers. */
+	uint64_t deadline;
+	/** Position in the timer heap, -1 if not there. */
+	int timer_pos;
+	/** True, if the last suspension ended by the deadline. */
+	bool is_timed_out;
+	/** Time spent running, in CPU cycles. */
+	uint64_t run_cycles;
+	/** Time spent not running - ready or suspended. */
+	uint64_t wait_cycles;
+	/** Time spent ready, waiting for the CPU. */
+	uint64_t ready_cycles;
+	/** The longest time the coroutine has run without a switch. */
+	uint64_t max_run_cycles;
+	/** When the coroutine was last switched in. */
+	uint64_t run_start;
+	/** When the coroutine was last switched out. */
+	uint64_t run_stop;
+	/** When the coroutine last became ready. */
+	uint64_t ready_start;
+	long long suspend_count;
+	/** The generator, if the coroutine is its producer. */
+	struct coro_gen *gen;
+	/**
+	 * The ready queue the coroutine is in, NULL if it is not
+	 * ready. In the multi-threaded mode it is changed under
+	 * the lock of the queue owner.
+	 */
+	struct coro_ready_queue *ready_queue;
+	/** Priority class, the ready queue it goes to. */
+	enum coro_priority priority;
+	/** Values of the fast coroutine-local keys. */
+	void *local[CORO_KEY_FAST_COUNT];
+	/** Next in the remote wakeup inbox. */
+	struct coro *remote_next;
+	/** True, if the coroutine is in the remote wakeup inbox. */
+	bool is_remote_queued;
+	/** Values of the other keys, allocated on the first set. */
+	void **local_slow;
+	/** Number of elements in local_slow. */
+	unsigned int local_slow_size;
+};
+
+/**
+ * What a worker thread should do with the coroutine which has
+ * just switched back to it. That can't be done by the coroutine
+ * itself - until the switch is complete, its context is not saved
+ * and no other thread may resume it.
+ */
+enum coro_post {
+	/** Yielded, put it back to the ready queue. */
+	CORO_POST_READY,
+	/** Suspended, release the scheduler lock it holds. */
+	CORO_POST_SUSPEND,
+	/** Finished, give it to coro_sched_wait(). */
+	CORO_POST_FINISH,
+};
+
+enum {
+	/**
+	 * How many times a non-empty priority class can be passed
+	 * over for the higher ones, before it gets a turn anyway.
+	 */
+	CORO_PRIO_AGING_LIMIT = 8,
+};
+
+/**
+ * Ready coroutines, a FIFO queue per priority class. The highest
+ * non-empty class runs first. But a lower class does not starve:
+ * each time it is passed over it ages, and an old enough class
+ * is served before the higher ones.
+ */
+struct coro_ready_queue {
+	struct rlist classes[CORO_PRIO_COUNT];
+	/** How many times each class was passed over in a row. */
+	int skip_count[CORO_PRIO_COUNT];
+	/** Number of coroutines in all the classes. */
+	int count;
+};
+
+static void
+coro_ready_queue_create(struct coro_ready_queue *q)
+{
+	for (int i = 0; i < CORO_PRIO_COUNT; ++i) {
+		rlist_create(&q->classes[i]);
+		q->skip_count[i] = 0;
+	}
+	q->count = 0;
+}
+
+static inline bool
+coro_ready_queue_is_empty(const struct coro_ready_queue *q)
+{
+	return q->count == 0;
+}
+
+/** Which ready coroutine runs next in its class. */
+static enum coro_sched_policy sched_policy = CORO_POLICY_FIFO;
+/** Order of CORO_POLICY_CUSTOM. */
+static coro_policy_less_f sched_policy_less = NULL;
+
+/**
+ * Add a coroutine to the queue according to the policy. A
+ * yielded one has had its turn, so it goes to the end unless a
+ * custom policy says otherwise.
+ */
+static inline void
+coro_ready_queue_push(struct coro_ready_queue *q, struct coro *c,
+		      bool is_yield)
+{
+	int prio = __atomic_load_n(&c->priority, __ATOMIC_RELAXED);
+	struct rlist *list = &q->classes[prio];
+	if (sched_policy == CORO_POLICY_FIFO ||
+	    (sched_policy == CORO_POLICY_LIFO && is_yield)) {
+		rlist_add_tail(list, &c->in_sched);
+	} else if (sched_policy == CORO_POLICY_LIFO) {
+		rlist_add_tail(list->next, &c->in_sched);
+	} else {
+		/* After the last one which is not worse, stable. */
+		struct rlist *pos = list->prev;
+		while (pos != list &&
+		       sched_policy_less(c, rlist_entry(pos, struct coro,
+							in_sched)))
+			pos = pos->prev;
+		rlist_add_tail(pos->next, &c->in_sched);
+	}
+	c->ready_queue = q;
+	++q->count;
+}
+
+/** Take the next coroutine to run, NULL if the queue is empty. */
+static inline struct coro *
+coro_ready_queue_pop(struct coro_ready_queue *q)
+{
+	if (q->count == 0)
+		return NULL;
+	int top = CORO_PRIO_COUNT - 1;
+	while (rlist_empty(&q->classes[top]))
+		--top;
+	int prio = top;
+	for (int i = 0; i < top; ++i) {
+		if (rlist_empty(&q->classes[i])) {
+			q->skip_count[i] = 0;
+		} else if (prio == top &&
+			   q->skip_count[i] >= CORO_PRIO_AGING_LIMIT) {
+			prio = i;
+		} else {
+			++q->skip_count[i];
+		}
+	}
+	q->skip_count[prio] = 0;
+	--q->count;
+	struct coro *c = rlist_shift_entry(&q->classes[prio], struct coro,
+					   in_sched);
+	c->ready_queue = NULL;
 	return c;
 }
+
+/** Remove a coroutine, wherever it is in the queue. */
+static inline void
+coro_ready_queue_remove(struct coro_ready_queue *q, struct coro *c)
+{
+	rlist_del(&c->in_sched);
+	c->ready_queue = NULL;
+	--q->count;
+}
+
+/**
+ * Coroutine scheduler of a thread. Each coroutine is always in
+ * one queue according to its state, so the scheduler never has
+ * to look for a coroutine to run or to return.
+ *
+ * In the single-threaded mode there is one scheduler, of the
+ * thread which has called coro_sched_init(). In the
+ * multi-threaded mode each worker thread has its own one too.
+ */
+struct coro_sched {
+	/**
+	 * Scheduler is a main coroutine - it catches and returns
+	 * dead ones to a user. In a worker thread it is the worker
+	 * loop.
+	 */
+	struct coro main;
+	/** Coroutines ready to run. */
+	struct coro_ready_queue ready;
+	/**
+	 * Suspended coroutines. The scheduler never looks at them
+	 * until they are woken up.
+	 */
+	struct rlist blocked;
+	/** Finished coroutines, not returned to the user yet. */
+	struct rlist finished;
+	/**
+	 * True, if in that moment the scheduler is waiting for a
+	 * coroutine finish.
+	 */
+	bool is_waiting;
+	/** Stacks of the deleted coroutines. */
+	struct coro_stack_pool stack_pool;
+	/** Yields since the last check of the I/O and timers. */
+	unsigned yields_since_poll;
+	/** Number of not finished coroutines. */
+	int coro_count;
+	/**
+	 * Each coroutine should get the CPU at least once during
+	 * this time, in nanoseconds. 0 means no limit.
+	 */
+	uint64_t target_latency;
+	/**
+	 * Time slice of a coroutine in coro_yield_if_expired(), in
+	 * cycles. It is the target latency divided between all the
+	 * coroutines.
+	 */
+	uint64_t quantum;
+	/*
+	 * The rest is used only by the worker threads.
+	 */
+	/**
+	 * Protects the ready queue, because other workers steal
+	 * from it and push the woken up coroutines into it.
+	 */
+	pthread_spinlock_t ready_lock;
+	/** Size of the ready queue, to check it without the lock. */
+	int ready_count;
+	/** The coroutine which has switched to the worker loop. */
+	struct coro *post_coro;
+	/** What to do with it. */
+	enum coro_post post;
+	/** Run it next, it was given the CPU by coro_yield_to(). */
+	struct coro *handoff;
+	pthread_t thread;
+	/*
+	 * The shared stack. Used only in the single-threaded mode.
+	 */
+	/** Allocated with the first coroutine, which needs it. */
+	void *shared_stack;
+	/**
+	 * The coroutine whose frames are on the shared stack now.
+	 * It keeps them there even when not running, until
+	 * another one needs the stack.
+	 */
+	struct coro *shared_owner;
+	/**
+	 * A context on a separate stack, which copies the stack
+	 * when its owner switches to another coroutine using it.
+	 * The owner can't do that itself - it would overwrite its
+	 * own frames.
+	 */
+	struct coro_ctx shared_copier;
+	void *shared_copier_stack;
+	/** Whom the copier runs after the copying. */
+	struct coro *shared_next;
+	/** Sends SIGALRM to the thread, if preemption is on. */
+	timer_t preempt_timer;
+	bool has_preempt_timer;
+	/** Set by the signal handler - the running one is overdue. */
+	volatile sig_atomic_t is_preempt_pending;
+};
+
+enum {
+	/**
+	 * How often coro_yield() checks I/O readiness and timers,
+	 * if anybody waits for them. Otherwise the coroutines,
+	 * yielding to each other, would never let the waiters run.
+	 */
+	CORO_POLL_YIELD_INTERVAL = 64,
+	/** Max events processed by a single epoll_wait(). */
+	CORO_POLL_EVENT_COUNT = 128,
+	/** Max number of file operations in flight in io_uring. */
+	CORO_URING_ENTRIES = 64,
+	/** Helper threads for the blocking calls. */
+	CORO_OFFLOAD_THREAD_COUNT = 4,
+};
+
+/** Coroutines waiting for a file descriptor. */
+struct coro_fd {
+	/** Waiting until the fd is readable. */
+	struct coro_wait_queue readers;
+	/** Waiting until the fd is writable. */
+	struct coro_wait_queue writers;
+	/**
+	 * Readiness events counters. A coroutine remembers them
+	 * before an operation, and does not wait if an event came
+	 * after that. In the multi-threaded mode it could come
+	 * between EAGAIN and the wait, and would be lost.
+	 */
+	unsigned read_events;
+	unsigned write_events;
+	/** True, if the fd is in the epoll. */
+	bool is_registered;
+	/** True, if the fd was switched to the non-blocking mode. */
+	bool is_nonblock;
+	/**
+	 * True, if the fd is a file. Epoll can't wait for files,
+	 * they are read and written via io_uring.
+	 */
+	bool is_file;
+};
+
+/**
+ * Io_uring for the file I/O. It is used via the raw syscalls.
+ * The ring fd is in the epoll, so the completions are harvested
+ * by the same poller as the other events, in batches.
+ */
+struct coro_uring {
+	/** Ring fd, -1 if not created yet. */
+	int fd;
+	/** True, if io_uring is not supported or disabled. */
+	bool is_unavailable;
+	/** True, if offset -1 means the current file position. */
+	bool has_cur_pos;
+	/** Submission queue ring, shared with the kernel. */
+	void *sq_ring;
+	size_t sq_ring_size;
+	unsigned *sq_tail;
+	unsigned sq_mask;
+	unsigned *sq_array;
+	struct io_uring_sqe *sqes;
+	size_t sqes_size;
+	/** Completion queue ring. */
+	void *cq_ring;
+	size_t cq_ring_size;
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned cq_mask;
+	struct io_uring_cqe *cqes;
+	/**
+	 * Submitted and not completed requests. They are not more
+	 * than the submission queue size, so the completion queue,
+	 * twice as big, never overflows.
+	 */
+	unsigned inflight;
+	unsigned entries;
+	/** Waiting for a free slot. */
+	struct coro_wait_queue waiters;
+};
+
+/**
+ * Waits for I/O and deadlines, on behalf of all the schedulers.
+ * In the multi-threaded mode it is protected by the scheduler
+ * lock, and it is polled by one idle worker at a time.
+ */
+struct coro_poller {
+	/** Epoll descriptor, created on the first I/O wait. */
+	int epoll_fd;
+	/** State of the descriptors, indexed by fd. */
+	struct coro_fd **fds;
+	/** Size of the descriptor table. */
+	int fd_count;
+	/** Coroutines suspended until an fd is ready. */
+	int io_wait_count;
+	/**
+	 * Min-heap of the coroutines suspended with a deadline,
+	 * the earliest deadline is on top.
+	 */
+	struct coro **timers;
+	int timer_count;
+	int timer_capacity;
+	/**
+	 * Eventfd in the epoll, to interrupt a worker sleeping in
+	 * epoll_wait(). In the single-threaded mode it is created
+	 * only for the remote wakeups.
+	 */
+	int event_fd;
+	/** True, if a worker is polling now. */
+	bool is_polling;
+	struct coro_uring uring;
+};
+
+/**
+ * Worker threads of the multi-threaded mode. Each has its own
+ * scheduler and runs the coroutines of its ready queue. An idle
+ * worker steals the coroutines from the others, so a coroutine
+ * can resume in a different thread than it was suspended in.
+ *
+ * The ready queues are protected by their own spinlocks, so
+ * yields don't contend. Everything else which could be touched
+ * by several threads - suspended coroutines, wait queues, the
+ * poller - is protected by one scheduler lock.
+ */
+struct coro_mt {
+	/** Number of workers, 0 in the single-threaded mode. */
+	int thread_count;
+	struct coro_sched *workers;
+	/** The scheduler lock. */
+	pthread_mutex_t lock;
+	/** Idle workers sleep on it until there is work. */
+	pthread_cond_t idle_cond;
+	/** coro_sched_wait() sleeps on it. */
+	pthread_cond_t finish_cond;
+	/** Workers not running coroutines, sleeping or polling. */
+	int idle_count;
+	/** Workers sleeping on the idle condition. */
+	int sleeping_count;
+	/**
+	 * Coroutines which are ready or running. When there are
+	 * none, only the poller can produce new ones.
+	 */
+	int active_count;
+	/**
+	 * Which worker gets the next coroutine made ready not by
+	 * a worker, for example created by the main thread.
+	 */
+	unsigned next_worker;
+	/** True, if the workers should exit. */
+	bool is_shutdown;
+};
+
+/** Scheduler of the thread which called coro_sched_init(). */
+static struct coro_sched sched_main = {
+	.stack_pool = {
+		.max_size = CORO_STACK_POOL_MAX_SIZE_DEFAULT,
+	},
+};
+static struct coro_poller poller = {
+	.epoll_fd = -1,
+	.event_fd = -1,
+	.uring = {
+		.fd = -1,
+	},
+};
+/**
+ * Helper threads, running the blocking calls on behalf of the
+ * coroutines. They don't touch the schedulers. A done call is
+ * put into a list, and the poller is woken up via an eventfd to
+ * wake the coroutine up in its scheduler.
+ */
+struct coro_offload {
+	/** Protects the lists, not the scheduler lock. */
+	pthread_mutex_t lock;
+	/** Idle helpers wait on it for a job. */
+	pthread_cond_t cond;
+	/** Calls to run, the oldest first. */
+	struct coro_offload_job *head;
+	struct coro_offload_job *tail;
+	/** Done calls, not seen by the poller yet. */
+	struct coro_offload_job *done;
+	/** Eventfd in the epoll, signaled on a done call. */
+	int event_fd;
+	/** 0, if the helpers are not started yet. */
+	int thread_count;
+	pthread_t threads[CORO_OFFLOAD_THREAD_COUNT];
+	bool is_shutdown;
+};
+
+static struct coro_offload offload = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.cond = PTHREAD_COND_INITIALIZER,
+	.event_fd = -1,
+};
+/**
+ * Coroutines woken up by other threads, a lock-free stack. The
+ * scheduler takes it whole when it polls.
+ */
+static struct coro *remote_inbox = NULL;
+static struct coro_mt mt = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.idle_cond = PTHREAD_COND_INITIALIZER,
+	.finish_cond = PTHREAD_COND_INITIALIZER,
+};
+/** Scheduler of the current thread. */
+static __thread struct coro_sched *sched = NULL;
+/** Which coroutine works at this moment in this thread. */
+static __thread struct coro *coro_this_ptr = NULL;
+/** How many times this thread has taken the scheduler lock. */
+static __thread int lock_depth = 0;
+/** Number of created coroutine-local keys. */
+static unsigned int key_count = 0;
+/** Destructors of the coroutine-local keys, by key. */
+static void (*key_destructors[CORO_KEY_MAX])(void *);
+/** Measure all the stacks and report them, LIBCORO_STACK_CHECK. */
+static bool is_stack_check_forced = false;
+
+/** All not deleted coroutines, under the scheduler lock. */
+static struct rlist all_coros = {&all_coros, &all_coros};
+
+/** A slice longer than that is reported, UINT64_MAX if none. */
+static uint64_t long_slice_cycles = UINT64_MAX;
+static uint64_t long_slice_ns = 0;
+static coro_long_slice_f long_slice_hook = NULL;
+
+/** Preemption time slice, set by the user. */
+static uint64_t preempt_slice_ns = 0;
+/** The same in cycles, 0 if the scheduler has no preemption. */
+static uint64_t preempt_slice_cycles = 0;
+static long long preempt_count = 0;
+
+static inline bool
+coro_is_mt(void)
+{
+	return mt.thread_count > 0;
+}
+
+/**
+ * A compiler may keep the address of a thread-local variable in
+ * a register across a context switch, while the coroutine can
+ * resume in another thread. The lock depth is accessed across
+ * the switches, so it is always accessed via this function.
+ */
+static __attribute__((noinline)) int *
+coro_lock_depth(void)
+{
+	int *depth = &lock_depth;
+	__asm__ __volatile__("" : "+r"(depth));
+	return depth;
+}
+
+void
+coro_sched_lock(void)
+{
+	if (! coro_is_mt())
+		return;
+	if ((*coro_lock_depth())++ == 0)
+		pthread_mutex_lock(&mt.lock);
+}
+
+void
+coro_sched_unlock(void)
+{
+	if (! coro_is_mt())
+		return;
+	if (--(*coro_lock_depth()) == 0)
+		pthread_mutex_unlock(&mt.lock);
+}
+
+void
+coro_stack_pool_set_max_size(size_t size)
+{
+	sched->stack_pool.max_size = size;
+	coro_stack_pool_trim(&sched->stack_pool, size);
+}
+
+void
+coro_stack_pool_stat(struct coro_stack_pool_stat *stat)
+{
+	stat->hits = sched->stack_pool.hits;
+	stat->misses = sched->stack_pool.misses;
+	stat->size = sched->stack_pool.size;
+	stat->max_size = sched->stack_pool.max_size;
+}
+
+size_t
+coro_stack_used(const struct coro *c)
+{
+	if (c->is_stack_shared)
+		return c->stack_copy_capacity;
+	if (!c->is_stack_measured)
+		return 0;
+	return coro_stack_measure(c->stack, c->stack_size);
+}
+
+int
+coro_status(const struct coro *c)
+{
+	return c->ret;
+}
+
+long long
+coro_switch_count(const struct coro *c)
+{
+	return c->switch_count;
+}
+
+bool
+coro_is_stack_shared(const struct coro *c)
+{
+	return c->is_stack_shared;
+}
+
+bool
+coro_is_finished(const struct coro *c)
+{
+	return c->state == CORO_STATE_FINISHED;
+}
+
+void
+coro_delete(struct coro *c)
+{
+	coro_sched_lock();
+	rlist_del(&c->in_all);
+	coro_sched_unlock();
+	if (is_stack_check_forced) {
+		fprintf(stderr, "coro %p: stack used %zu of %zu bytes\n",
+			(void *)c, coro_stack_used(c), c->stack_size);
+	}
+	if (c->is_stack_shared) {
+		if (sched->shared_owner == c)
+			sched->shared_owner = NULL;
+		free(c->stack_copy);
+	} else {
+		coro_stack_pool_put(&sched->stack_pool, c->stack,
+				    c->stack_size);
+	}
+	free(c->local_slow);
+	free(c);
+}
+
+/**
+ * Time accounting is done in CPU cycles, because they are
+ * cheaper to read than a clock. It is done on each switch, so it
+ * should cost nothing.
+ */
+static inline uint64_t
+coro_cycles(void)
+{
+#if defined(__x86_64__)
+	return __rdtsc();
+#elif defined(__aarch64__)
+	uint64_t cycles;
+	__asm__ __volatile__("mrs %0, cntvct_el0" : "=r"(cycles));
+	return cycles;
+#else
+	return coro_clock_ns();
+#endif
+}
+
+/** Length of a cycle, calibrated on the first scheduler creation. */
+static double ns_per_cycle = 0;
+
+static void
+coro_cycles_calibrate(void)
+{
+	if (ns_per_cycle != 0)
+		return;
+#if defined(__x86_64__)
+	/*
+	 * Invariant TSC ticks with a constant rate, but it is not
+	 * known. Measure it against the clock.
+	 */
+	uint64_t ns_start = coro_clock_ns();
+	uint64_t cycles_start = coro_cycles();
+	uint64_t ns_end;
+	do {
+		ns_end = coro_clock_ns();
+	} while (ns_end - ns_start < 500000);
+	uint64_t cycles = coro_cycles() - cycles_start;
+	ns_per_cycle = (double)(ns_end - ns_start) / cycles;
+#elif defined(__aarch64__)
+	uint64_t freq;
+	__asm__ __volatile__("mrs %0, cntfrq_el0" : "=r"(freq));
+	ns_per_cycle = 1e9 / freq;
+#else
+	ns_per_cycle = 1;
+#endif
+}
+
+static inline uint64_t
+coro_cycles_to_ns(uint64_t cycles)
+{
+	return cycles * ns_per_cycle;
+}
+
+/** Account the time of a switch between two coroutines. */
+static void
+coro_long_slice(struct coro *c, uint64_t cycles);
+
+static inline void
+coro_account_switch(struct coro *from, struct coro *to)
+{
+	uint64_t now = coro_cycles();
+	uint64_t run = now - from->run_start;
+	from->run_cycles += run;
+	if (run > from->max_run_cycles)
+		from->max_run_cycles = run;
+	if (run >= long_slice_cycles && from != &sched->main)
+		coro_long_slice(from, run);
+	from->run_stop = now;
+	/* A suspended one becomes ready only on wakeup. */
+	from->ready_start = now;
+	to->wait_cycles += now - to->run_stop;
+	to->ready_cycles += now - to->ready_start;
+	to->run_start = now;
+}
+
+/**
+ * Recalculate the time slice after the coroutine count change.
+ * The workers run the coroutines in parallel, so each coroutine
+ * shares the target latency only with the ones of its thread.
+ */
+static void
+coro_sched_update_quantum(void)
+{
+	int count = sched_main.coro_count;
+	if (coro_is_mt())
+		count = (count + mt.thread_count - 1) / mt.thread_count;
+	if (count == 0)
+		count = 1;
+	sched_main.quantum = sched_main.target_latency / ns_per_cycle /
+			     count;
+}
+
+void
+coro_sched_set_target_latency(uint64_t ns)
+{
+	coro_sched_lock();
+	sched_main.target_latency = ns;
+	coro_sched_update_quantum();
+	coro_sched_unlock();
+}
+
+/**
+ * Report a too long slice. It is called on the stack of the
+ * coroutine, right before it switches out, so the backtrace
+ * shows where it has finally given up the CPU.
+ */
+static void __attribute__((noinline, cold))
+coro_long_slice(struct coro *c, uint64_t cycles)
+{
+	uint64_t ns = coro_cycles_to_ns(cycles);
+	if (long_slice_hook != NULL) {
+		long_slice_hook(c, ns);
+		return;
+	}
+	fprintf(stderr, "coro %p '%s' ran %llu us without a switch, "
+		"until:\n", (void *)c, c->name, (unsigned long long)ns / 1000);
+	fflush(stderr);
+#if CORO_CTX_ASM
+	void *frames[32];
+	int count = backtrace(frames, sizeof(frames) / sizeof(frames[0]));
+	backtrace_symbols_fd(frames, count, STDERR_FILENO);
+#else
+	/*
+	 * The unwinder would go from the trampoline into the signal
+	 * frame it was started from, and that is long gone.
+	 */
+	fprintf(stderr, "(no backtrace with the sigaltstack contexts)\n");
+#endif
+}
+
+static void
+coro_long_slice_update(void)
+{
+	if (long_slice_ns == 0)
+		long_slice_cycles = UINT64_MAX;
+	else
+		long_slice_cycles = long_slice_ns / ns_per_cycle;
+}
+
+void
+coro_sched_set_long_slice(uint64_t threshold_ns, coro_long_slice_f hook)
+{
+	long_slice_ns = threshold_ns;
+	long_slice_hook = hook;
+	if (ns_per_cycle > 0)
+		coro_long_slice_update();
+}
+
+uint64_t
+coro_run_time(const struct coro *c)
+{
+	uint64_t cycles = c->run_cycles;
+	if (c->state == CORO_STATE_RUNNING)
+		cycles += coro_cycles() - c->run_start;
+	return coro_cycles_to_ns(cycles);
+}
+
+uint64_t
+coro_wait_time(const struct coro *c)
+{
+	uint64_t cycles = c->wait_cycles;
+	if (c->state == CORO_STATE_READY ||
+	    c->state == CORO_STATE_SUSPENDED)
+		cycles += coro_cycles() - c->run_stop;
+	return coro_cycles_to_ns(cycles);
+}
+
+uint64_t
+coro_ready_time(const struct coro *c)
+{
+	uint64_t cycles = c->ready_cycles;
+	if (c->state == CORO_STATE_READY)
+		cycles += coro_cycles() - c->ready_start;
+	return coro_cycles_to_ns(cycles);
+}
+
+uint64_t
+coro_max_run_time(const struct coro *c)
+{
+	uint64_t cycles = c->max_run_cycles;
+	if (c->state == CORO_STATE_RUNNING &&
+	    coro_cycles() - c->run_start > cycles)
+		cycles = coro_cycles() - c->run_start;
+	return coro_cycles_to_ns(cycles);
+}
+
+long long
+coro_suspend_count(const struct coro *c)
+{
+	return c->suspend_count;
+}
+
+#if CORO_CTX_ASM
+
+/**
+ * Shared stack. Coroutines created with is_stack_shared all run
+ * on one stack of the scheduler. A switched out coroutine leaves
+ * its frames there, until another one needs the stack. Only then
+ * the frames are copied into a heap buffer of the exact size,
+ * and copied back before the coroutine runs again. They are
+ * restored to the same addresses, so pointers to the locals stay
+ * valid. A suspended coroutine then costs its used stack part,
+ * usually a few hundred bytes, instead of a whole mapping.
+ *
+ * The frames start at the saved stack pointer, which only the
+ * assembly switch gives, so it works only with it. And the
+ * coroutine can't move to another thread and its shared stack.
+ */
+static inline char *
+coro_shared_stack_top(const struct coro_sched *s)
+{
+	uintptr_t top = (uintptr_t)s->shared_stack + CORO_SHARED_STACK_SIZE;
+	return (char *)(top & ~(uintptr_t)15);
+}
+
+/** Save the frames of a switched out coroutine into its copy. */
+static void
+coro_shared_stack_save(struct coro_sched *s, struct coro *c)
+{
+	size_t size = coro_shared_stack_top(s) - (char *)c->ctx.sp;
+	if (size > c->stack_copy_capacity) {
+		c->stack_copy = realloc(c->stack_copy, size);
+		if (c->stack_copy == NULL)
+			handle_error();
+		c->stack_copy_capacity = size;
+	}
+	memcpy(c->stack_copy, c->ctx.sp, size);
+	c->stack_copy_size = size;
+}
+
+/** Give the shared stack to @a c, which is not running now. */
+static void
+coro_shared_stack_take(struct coro_sched *s, struct coro *c)
+{
+	struct coro *owner = s->shared_owner;
+	if (owner != NULL && owner->state != CORO_STATE_FINISHED)
+		coro_shared_stack_save(s, owner);
+	memcpy(coro_shared_stack_top(s) - c->stack_copy_size, c->stack_copy,
+	       c->stack_copy_size);
+	s->shared_owner = c;
+}
+
+static void
+coro_shared_copier_f(void *arg)
+{
+	struct coro_sched *s = arg;
+	while (true) {
+		coro_shared_stack_take(s, s->shared_next);
+		coro_ctx_switch(&s->shared_copier, &s->shared_next->ctx);
+	}
+}
+
+/**
+ * Prepare the first frame of a coroutine on the shared stack.
+ * It is built aside and saved as the coroutine stack copy, so
+ * the current owner of the stack is not damaged.
+ */
+static void
+coro_shared_stack_create(struct coro *c, void (*body)(void *))
+{
+	struct coro_sched *s = sched;
+	if (s->shared_stack == NULL) {
+		s->shared_stack = coro_stack_new(CORO_SHARED_STACK_SIZE);
+		s->shared_copier_stack =
+			coro_stack_new(CORO_SHARED_COPIER_STACK_SIZE);
+		coro_ctx_create(&s->shared_copier, s->shared_copier_stack,
+				CORO_SHARED_COPIER_STACK_SIZE,
+				coro_shared_copier_f, s);
+	}
+	uint64_t frame[CORO_CTX_FRAME_WORDS + 2] __attribute__((aligned(16)));
+	coro_ctx_create(&c->ctx, frame, sizeof(frame), body, c);
+	c->stack_copy_size = (char *)(frame + CORO_CTX_FRAME_WORDS + 2) -
+			     (char *)c->ctx.sp;
+	c->stack_copy_capacity = c->stack_copy_size;
+	c->stack_copy = malloc(c->stack_copy_size);
+	if (c->stack_copy == NULL)
+		handle_error();
+	memcpy(c->stack_copy, c->ctx.sp, c->stack_copy_size);
+	c->ctx.sp = coro_shared_stack_top(s) - c->stack_copy_size;
+}
+
+/** Free the shared stack of the scheduler. */
+static void
+coro_shared_stack_destroy(struct coro_sched *s)
+{
+	if (s->shared_stack == NULL)
+		return;
+	coro_stack_delete(s->shared_stack, CORO_SHARED_STACK_SIZE);
+	coro_stack_delete(s->shared_copier_stack,
+			  CORO_SHARED_COPIER_STACK_SIZE);
+	s->shared_stack = NULL;
+	s->shared_copier_stack = NULL;
+	s->shared_owner = NULL;
+}
+
+#else /* ! CORO_CTX_ASM */
+
+static inline char *
+coro_shared_stack_top(const struct coro_sched *s)
+{
+	return s->shared_stack;
+}
+
+static void
+coro_shared_stack_create(struct coro *c, void (*body)(void *))
+{
+	(void)c;
+	(void)body;
+	abort();
+}
+
+static void
+coro_shared_stack_destroy(struct coro_sched *s)
+{
+	(void)s;
+}
+
+#endif /* ! CORO_CTX_ASM */
+
+/**
+ * True, if @a p is in the frames of the current coroutine on the
+ * shared stack. While it waits, another coroutine can take the
+ * stack, so nobody else may write there - a helper thread or
+ * the kernel.
+ */
+static bool
+coro_is_on_shared_stack(const void *p)
+{
+	struct coro_sched *s = sched;
+	if (! coro_this_ptr->is_stack_shared)
+		return false;
+	return (const char *)p >= (const char *)s->shared_stack &&
+	       (const char *)p < coro_shared_stack_top(s);
+}
+
+/**
+ * Switch the current coroutine to an arbitrary one. The current
+ * coroutine pointer is set before the switch, because after it
+ * the coroutine can be in another thread.
+ */
+static inline void
+coro_switch_to(struct coro *to)
+{
+	struct coro *from = coro_this_ptr;
+	coro_account_switch(from, to);
+	to->state = CORO_STATE_RUNNING;
+	coro_this_ptr = to;
+#if CORO_CTX_ASM
+	struct coro_sched *s = sched;
+	if (to->is_stack_shared && s->shared_owner != to) {
+		if (from == s->shared_owner) {
+			/* Can't copy the stack while running on it. */
+			s->shared_next = to;
+			coro_ctx_switch(&from->ctx, &s->shared_copier);
+			return;
+		}
+		coro_shared_stack_take(s, to);
+	}
+#endif
+	coro_ctx_switch(&from->ctx, &to->ctx);
+}
+
+/**
+ * Switch to the next ready coroutine. If there are none, then
+ * to the scheduler. The current coroutine should be already put
+ * wherever it belongs.
+ */
+static inline void
+coro_yield_next(void)
+{
+	struct coro *to = coro_ready_queue_pop(&sched->ready);
+	coro_switch_to(to != NULL ? to : &sched->main);
+}
+
+/**
+ * Switch from a coroutine to the loop of its worker, which will
+ * do @a post with it.
+ */
+static inline void
+coro_worker_switch(struct coro *c, enum coro_post post)
+{
+	struct coro_sched *w = sched;
+	w->post_coro = c;
+	w->post = post;
+	coro_switch_to(&w->main);
+}
+
+/** Push a coroutine into the ready queue of a worker. */
+static void
+coro_worker_push(struct coro_sched *w, struct coro *c, bool is_yield)
+{
+	c->state = CORO_STATE_READY;
+	pthread_spin_lock(&w->ready_lock);
+	coro_ready_queue_push(&w->ready, c, is_yield);
+	/*
+	 * Sequentially consistent together with the idle count.
+	 * Either the pusher sees an idle worker and wakes it up,
+	 * or the worker sees the new coroutine before sleeping.
+	 */
+	__atomic_add_fetch(&w->ready_count, 1, __ATOMIC_SEQ_CST);
+	pthread_spin_unlock(&w->ready_lock);
+}
+
+/** Pop the first ready coroutine of a worker, if any. */
+static struct coro *
+coro_worker_pop(struct coro_sched *w)
+{
+	if (__atomic_load_n(&w->ready_count, __ATOMIC_SEQ_CST) == 0)
+		return NULL;
+	pthread_spin_lock(&w->ready_lock);
+	struct coro *c = coro_ready_queue_pop(&w->ready);
+	if (c != NULL)
+		__atomic_sub_fetch(&w->ready_count, 1, __ATOMIC_RELAXED);
+	pthread_spin_unlock(&w->ready_lock);
+	return c;
+}
+
+/** Write to the eventfd, to interrupt the polling worker. */
+static void
+coro_poller_kick(void)
+{
+	uint64_t one = 1;
+	if (write(poller.event_fd, &one, sizeof(one)) < 0 &&
+	    errno != EAGAIN)
+		handle_error();
+}
+
+/** Wake up an idle worker, if there is one, to run new work. */
+static void
+coro_worker_notify(void)
+{
+	if (__atomic_load_n(&mt.idle_count, __ATOMIC_SEQ_CST) == 0)
+		return;
+	coro_sched_lock();
+	if (mt.sleeping_count > 0)
+		pthread_cond_signal(&mt.idle_cond);
+	else if (poller.is_polling)
+		coro_poller_kick();
+	coro_sched_unlock();
+}
+
+/**
+ * Make a coroutine runnable in the multi-threaded mode. A worker
+ * keeps it in its own queue, other threads spread the coroutines
+ * between the workers. Is called under the scheduler lock.
+ */
+static void
+coro_mt_make_ready(struct coro *c)
+{
+	++mt.active_count;
+	struct coro_sched *w = sched;
+	if (w == &sched_main)
+		w = &mt.workers[mt.next_worker++ % mt.thread_count];
+	coro_worker_push(w, c, false);
+	coro_worker_notify();
+}
+
+static void
+coro_sched_poll(int64_t timeout);
+
+static bool
+coro_sched_step(void);
+
+uint64_t
+coro_clock_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static inline bool
+coro_timer_less(const struct coro *a, const struct coro *b)
+{
+	return a->deadline < b->deadline;
+}
+
+static inline void
+coro_timer_set(int pos, struct coro *c)
+{
+	poller.timers[pos] = c;
+	c->timer_pos = pos;
+}
+
+static void
+coro_timer_sift_up(int pos)
+{
+	struct coro *c = poller.timers[pos];
+	while (pos > 0) {
+		int parent = (pos - 1) / 2;
+		if (! coro_timer_less(c, poller.timers[parent]))
+			break;
+		coro_timer_set(pos, poller.timers[parent]);
+		pos = parent;
+	}
+	coro_timer_set(pos, c);
+}
+
+static void
+coro_timer_sift_down(int pos)
+{
+	struct coro *c = poller.timers[pos];
+	while (true) {
+		int child = 2 * pos + 1;
+		if (child >= poller.timer_count)
+			break;
+		if (child + 1 < poller.timer_count &&
+		    coro_timer_less(poller.timers[child + 1],
+				    poller.timers[child]))
+			++child;
+		if (! coro_timer_less(poller.timers[child], c))
+			break;
+		coro_timer_set(pos, poller.timers[child]);
+		pos = child;
+	}
+	coro_timer_set(pos, c);
+}
+
+/**
+ * A new fd or deadline appeared in the poller. If no worker
+ * polls, wake up one to do that. If one sleeps in epoll_wait(),
+ * it could be sleeping past the new deadline.
+ */
+static void
+coro_poller_notify(void)
+{
+	if (! coro_is_mt())
+		return;
+	if (poller.is_polling)
+		coro_poller_kick();
+	else if (mt.sleeping_count > 0)
+		pthread_cond_signal(&mt.idle_cond);
+}
+
+static void
+coro_timer_add(struct coro *c)
+{
+	if (poller.timer_count == poller.timer_capacity) {
+		int cap = poller.timer_capacity == 0 ? 64 :
+			  poller.timer_capacity * 2;
+		struct coro **timers = realloc(poller.timers,
+					       cap * sizeof(*timers));
+		if (timers == NULL)
+			handle_error();
+		poller.timers = timers;
+		poller.timer_capacity = cap;
+	}
+	int pos = poller.timer_count++;
+	coro_timer_set(pos, c);
+	coro_timer_sift_up(pos);
+	if (c->timer_pos == 0)
+		coro_poller_notify();
+}
+
+static void
+coro_timer_remove(struct coro *c)
+{
+	int pos = c->timer_pos;
+	c->timer_pos = -1;
+	struct coro *last = poller.timers[--poller.timer_count];
+	if (last == c)
+		return;
+	coro_timer_set(pos, last);
+	if (pos > 0 && coro_timer_less(last, poller.timers[(pos - 1) / 2]))
+		coro_timer_sift_up(pos);
+	else
+		coro_timer_sift_down(pos);
+}
+
+/**
+ * Wake up the coroutines whose deadlines have expired. Returns
+ * nanoseconds until the next deadline, or -1 if none.
+ */
+static int64_t
+coro_sched_process_timers(void)
+{
+	if (poller.timer_count == 0)
+		return -1;
+	int64_t timeout = -1;
+	uint64_t now = coro_clock_ns();
+	coro_sched_lock();
+	while (poller.timer_count > 0) {
+		struct coro *c = poller.timers[0];
+		if (c->deadline > now) {
+			timeout = c->deadline - now;
+			break;
+		}
+		coro_timer_remove(c);
+		c->is_timed_out = true;
+		coro_wakeup(c);
+	}
+	coro_sched_unlock();
+	return timeout;
+}
+
+/**
+ * True, if there are coroutines waiting for something the
+ * scheduler itself checks: fds and deadlines.
+ */
+static inline bool
+coro_sched_has_waiters(void)
+{
+	return poller.io_wait_count > 0 || poller.timer_count > 0;
+}
+
+/**
+ * In the single-threaded mode, check the I/O and the timers once
+ * in a while, even when there are ready coroutines always.
+ */
+static inline void
+coro_sched_poll_if_due(void)
+{
+	if (coro_sched_has_waiters() &&
+	    ++sched->yields_since_poll >= CORO_POLL_YIELD_INTERVAL) {
+		coro_sched_poll(0);
+		coro_sched_process_timers();
+	}
+}
+
+/**
+ * True, if the caller is the scheduler itself - the code calling
+ * coro_sched_wait(), not a coroutine.
+ */
+static inline bool
+coro_is_sched_context(void)
+{
+	return coro_this_ptr == &sched->main;
+}
+
+void
+coro_yield(void)
+{
+	struct coro *from = coro_this_ptr;
+	/*
+	 * The scheduler context is not in the queues, a coroutine
+	 * finishing after a switch from it would have nowhere to
+	 * return. The coroutines are run by coro_sched_wait().
+	 */
+	if (coro_is_sched_context()) {
+		if (! coro_is_mt())
+			coro_sched_poll_if_due();
+		return;
+	}
+	++from->switch_count;
+	if (coro_is_mt()) {
+		/* Other workers steal from a non-empty queue. */
+		if (__atomic_load_n(&sched->ready_count,
+				    __ATOMIC_RELAXED) != 0)
+			coro_worker_switch(from, CORO_POST_READY);
+		return;
+	}
+	coro_sched_poll_if_due();
+	if (coro_ready_queue_is_empty(&sched->ready))
+		return;
+	/* The current coroutine can be the most important one. */
+	coro_ready_queue_push(&sched->ready, from, true);
+	struct coro *to = coro_ready_queue_pop(&sched->ready);
+	if (to == from)
+		return;
+	from->state = CORO_STATE_READY;
+	coro_switch_to(to);
+}
+
+void
+coro_yield_to(struct coro *c)
+{
+	struct coro *from = coro_this_ptr;
+	if (c == from)
+		return;
+	if (coro_is_sched_context()) {
+		/*
+		 * Run it the way coro_sched_wait() does - the
+		 * scheduler context is not queued. In the
+		 * multi-threaded mode the workers run it anyway.
+		 */
+		if (coro_is_mt() || c->ready_queue == NULL)
+			return;
+		coro_sched_poll_if_due();
+		coro_ready_queue_remove(&sched->ready, c);
+		sched->is_waiting = true;
+		coro_switch_to(c);
+		sched->is_waiting = false;
+		return;
+	}
+	if (coro_is_mt()) {
+		/* Take it from the queue of whichever worker has it. */
+		struct coro_ready_queue *q =
+			__atomic_load_n(&c->ready_queue, __ATOMIC_ACQUIRE);
+		if (q == NULL) {
+			coro_yield();
+			return;
+		}
+		struct coro_sched *owner = rlist_entry(q, struct coro_sched,
+						       ready);
+		pthread_spin_lock(&owner->ready_lock);
+		if (c->ready_queue != q) {
+			/* Stolen or run meanwhile. */
+			pthread_spin_unlock(&owner->ready_lock);
+			coro_yield();
+			return;
+		}
+		coro_ready_queue_remove(q, c);
+		__atomic_sub_fetch(&owner->ready_count, 1, __ATOMIC_RELAXED);
+		pthread_spin_unlock(&owner->ready_lock);
+		++from->switch_count;
+		sched->handoff = c;
+		coro_worker_switch(from, CORO_POST_READY);
+		return;
+	}
+	if (c->ready_queue == NULL) {
+		coro_yield();
+		return;
+	}
+	++from->switch_count;
+	coro_sched_poll_if_due();
+	coro_ready_queue_remove(&sched->ready, c);
+	coro_ready_queue_push(&sched->ready, from, true);
+	from->state = CORO_STATE_READY;
+	coro_switch_to(c);
+}
+
+void
+coro_sched_set_policy(enum coro_sched_policy policy,
+		      coro_policy_less_f less)
+{
+	sched_policy = policy;
+	sched_policy_less = less;
+}
+
+void
+coro_set_priority(struct coro *c, enum coro_priority priority)
+{
+	if (coro_is_mt()) {
+		/* It can be in any worker's queue, let it be there. */
+		__atomic_store_n(&c->priority, priority, __ATOMIC_RELAXED);
+		return;
+	}
+	if (c->state != CORO_STATE_READY) {
+		c->priority = priority;
+		return;
+	}
+	coro_ready_queue_remove(&sched->ready, c);
+	c->priority = priority;
+	coro_ready_queue_push(&sched->ready, c, true);
+}
+
+/**
+ * Suspend the current coroutine, ignoring a pending wakeup. Is
+ * called under the scheduler lock. In the multi-threaded mode
+ * the lock is released only when the coroutine context is saved
+ * - then nobody can wake it up before it is really suspended.
+ * The lock is taken back after the wakeup.
+ */
+static void
+coro_suspend_do(struct coro *c)
+{
+	++c->switch_count;
+	++c->suspend_count;
+	c->state = CORO_STATE_SUSPENDED;
+	rlist_add_tail(&sched->blocked, &c->in_sched);
+	if (! coro_is_mt()) {
+		coro_yield_next();
+		return;
+	}
+	if (--mt.active_count == 0)
+		pthread_cond_signal(&mt.finish_cond);
+	int depth = *coro_lock_depth();
+	*coro_lock_depth() = 0;
+	coro_worker_switch(c, CORO_POST_SUSPEND);
+	pthread_mutex_lock(&mt.lock);
+	*coro_lock_depth() = depth;
+}
+
+void
+coro_yield_if_expired(void)
+{
+	if (coro_preempt_point())
+		return;
+	struct coro *c = coro_this_ptr;
+	if (coro_cycles() - c->run_start >= sched_main.quantum)
+		coro_yield();
+}
+
+/**
+ * Preemption. The signal handler can't switch the coroutine
+ * itself - it could interrupt malloc() or the scheduler holding
+ * a lock. So it only marks the coroutine, and the switch happens
+ * at a point where it is safe.
+ */
+static void
+coro_preempt_handler(int signum)
+{
+	(void)signum;
+	struct coro_sched *s = sched;
+	struct coro *c = coro_this_ptr;
+	if (s == NULL || c == &s->main || preempt_slice_cycles == 0)
+		return;
+	if (coro_cycles() - c->run_start >= preempt_slice_cycles)
+		s->is_preempt_pending = 1;
+}
+
+#ifndef sigev_notify_thread_id
+#define sigev_notify_thread_id _sigev_un._tid
+#endif
+
+/** Start the preemption timer of the current thread. */
+static void
+coro_preempt_timer_create(struct coro_sched *s)
+{
+	if (preempt_slice_cycles == 0)
+		return;
+	struct sigevent sev;
+	memset(&sev, 0, sizeof(sev));
+	sev.sigev_notify = SIGEV_THREAD_ID;
+	sev.sigev_signo = SIGALRM;
+	sev.sigev_notify_thread_id = syscall(SYS_gettid);
+	if (timer_create(CLOCK_MONOTONIC, &sev, &s->preempt_timer) != 0)
+		handle_error();
+	/* Tick twice per slice, to catch an overdue one in time. */
+	uint64_t period = preempt_slice_ns / 2;
+	struct itimerspec its;
+	its.it_interval.tv_sec = period / 1000000000;
+	its.it_interval.tv_nsec = period % 1000000000;
+	its.it_value = its.it_interval;
+	if (timer_settime(s->preempt_timer, 0, &its, NULL) != 0)
+		handle_error();
+	s->has_preempt_timer = true;
+}
+
+static void
+coro_preempt_timer_delete(struct coro_sched *s)
+{
+	if (! s->has_preempt_timer)
+		return;
+	if (timer_delete(s->preempt_timer) != 0)
+		handle_error();
+	s->has_preempt_timer = false;
+	s->is_preempt_pending = 0;
+}
+
+/**
+ * Turn the preemption on for a new scheduler, if it is enabled.
+ * The signal handler is left installed after that, a signal can
+ * still be on the way when the timers are deleted.
+ */
+static void
+coro_preempt_start(void)
+{
+	preempt_count = 0;
+	if (preempt_slice_ns == 0)
+		return;
+	struct sigaction sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = coro_preempt_handler;
+	sa.sa_flags = SA_RESTART;
+	sigemptyset(&sa.sa_mask);
+	if (sigaction(SIGALRM, &sa, NULL) != 0)
+		handle_error();
+	preempt_slice_cycles = preempt_slice_ns / ns_per_cycle;
+	if (preempt_slice_cycles == 0)
+		preempt_slice_cycles = 1;
+}
+
+void
+coro_sched_set_preemption(uint64_t slice_ns)
+{
+	preempt_slice_ns = slice_ns;
+}
+
+bool
+coro_preempt_point(void)
+{
+	struct coro_sched *s = sched;
+	if (! s->is_preempt_pending)
+		return false;
+	s->is_preempt_pending = 0;
+	struct coro *c = coro_this_ptr;
+	/* It could have switched after the mark. */
+	if (c == &s->main || coro_cycles() - c->run_start <
+	    preempt_slice_cycles)
+		return false;
+	__atomic_add_fetch(&preempt_count, 1, __ATOMIC_RELAXED);
+	coro_yield();
+	return true;
+}
+
+long long
+coro_sched_preempt_count(void)
+{
+	return __atomic_load_n(&preempt_count, __ATOMIC_RELAXED);
+}
+
+void
+coro_suspend(void)
+{
+	struct coro *c = coro_this_ptr;
+	coro_sched_lock();
+	if (c->is_wakeup_pending)
+		c->is_wakeup_pending = false;
+	else
+		coro_suspend_do(c);
+	coro_sched_unlock();
+}
+
+bool
+coro_suspend_until(uint64_t deadline)
+{
+	struct coro *c = coro_this_ptr;
+	coro_sched_lock();
+	if (c->is_wakeup_pending) {
+		c->is_wakeup_pending = false;
+		coro_sched_unlock();
+		return true;
+	}
+	c->deadline = deadline;
+	c->is_timed_out = false;
+	coro_timer_add(c);
+	coro_suspend_do(c);
+	if (c->timer_pos >= 0)
+		coro_timer_remove(c);
+	coro_sched_unlock();
+	return ! c->is_timed_out;
+}
+
+void
+coro_sleep(uint64_t ns)
+{
+	uint64_t deadline = coro_clock_ns() + ns;
+	while (coro_suspend_until(deadline));
+}
+
+void
+coro_wakeup(struct coro *c)
+{
+	coro_sched_lock();
+	switch (c->state) {
+	case CORO_STATE_SUSPENDED:
+		rlist_del(&c->in_sched);
+		c->ready_start = coro_cycles();
+		if (coro_is_mt()) {
+			coro_mt_make_ready(c);
+			break;
+		}
+		c->state = CORO_STATE_READY;
+		coro_ready_queue_push(&sched->ready, c, false);
+		break;
+	case CORO_STATE_READY:
+	case CORO_STATE_RUNNING:
+		/*
+		 * In the multi-threaded mode these two can change
+		 * without the lock, but they mean the same here.
+		 */
+		c->is_wakeup_pending = true;
+		break;
+	case CORO_STATE_FINISHED:
+		break;
+	}
+	coro_sched_unlock();
+}
+
+void
+coro_wait_queue_create(struct coro_wait_queue *wq)
+{
+	rlist_create(&wq->waiters);
+}
+
+bool
+coro_wait_queue_is_empty(const struct coro_wait_queue *wq)
+{
+	return rlist_empty(&wq->waiters);
+}
+
+void
+coro_wait_queue_wait(struct coro_wait_queue *wq)
+{
+	struct coro *c = coro_this_ptr;
+	coro_sched_lock();
+	rlist_add_tail(&wq->waiters, &c->in_wait);
+	if (c->is_wakeup_pending)
+		c->is_wakeup_pending = false;
+	else
+		coro_suspend_do(c);
+	/* Could be woken up not via the queue. */
+	rlist_del(&c->in_wait);
+	coro_sched_unlock();
+}
+
+struct coro *
+coro_wait_queue_wakeup_one(struct coro_wait_queue *wq)
+{
+	coro_sched_lock();
+	struct coro *c = NULL;
+	if (! rlist_empty(&wq->waiters)) {
+		c = rlist_shift_entry(&wq->waiters, struct coro, in_wait);
+		coro_wakeup(c);
+	}
+	coro_sched_unlock();
+	return c;
+}
+
+void
+coro_wait_queue_wakeup_all(struct coro_wait_queue *wq)
+{
+	coro_sched_lock();
+	while (coro_wait_queue_wakeup_one(wq) != NULL);
+	coro_sched_unlock();
+}
+
+/**
+ * Bounded channel. The elements are stored in a ring buffer
+ * right after the channel object.
+ */
+struct coro_chan {
+	/** Coroutines waiting for a free slot. */
+	struct coro_wait_queue senders;
+	/** Coroutines waiting for an element. */
+	struct coro_wait_queue receivers;
+	/** Max number of elements in the buffer. */
+	size_t capacity;
+	size_t elem_size;
+	/** Index of the oldest element. */
+	size_t head;
+	/** Number of elements in the buffer. */
+	size_t count;
+	bool is_closed;
+	char data[];
+};
+
+struct coro_chan *
+coro_chan_new(size_t capacity, size_t elem_size)
+{
+	if (capacity == 0)
+		capacity = 1;
+	struct coro_chan *ch = malloc(sizeof(*ch) + capacity * elem_size);
+	if (ch == NULL)
+		handle_error();
+	coro_wait_queue_create(&ch->senders);
+	coro_wait_queue_create(&ch->receivers);
+	ch->capacity = capacity;
+	ch->elem_size = elem_size;
+	ch->head = 0;
+	ch->count = 0;
+	ch->is_closed = false;
+	return ch;
+}
+
+void
+coro_chan_delete(struct coro_chan *ch)
+{
+	free(ch);
+}
+
+void
+coro_chan_close(struct coro_chan *ch)
+{
+	coro_sched_lock();
+	ch->is_closed = true;
+	coro_wait_queue_wakeup_all(&ch->senders);
+	coro_wait_queue_wakeup_all(&ch->receivers);
+	coro_sched_unlock();
+}
+
+/**
+ * Copy @a count elements into the buffer, which has room for
+ * them. The ring can wrap, so it takes up to 2 copies.
+ */
+static void
+coro_chan_put(struct coro_chan *ch, const char *elems, size_t count)
+{
+	size_t tail = (ch->head + ch->count) % ch->capacity;
+	size_t first = ch->capacity - tail;
+	if (first > count)
+		first = count;
+	memcpy(ch->data + tail * ch->elem_size, elems,
+	       first * ch->elem_size);
+	memcpy(ch->data, elems + first * ch->elem_size,
+	       (count - first) * ch->elem_size);
+	ch->count += count;
+}
+
+/** Copy @a count oldest elements out of the buffer. */
+static void
+coro_chan_take(struct coro_chan *ch, char *elems, size_t count)
+{
+	size_t first = ch->capacity - ch->head;
+	if (first > count)
+		first = count;
+	memcpy(elems, ch->data + ch->head * ch->elem_size,
+	       first * ch->elem_size);
+	memcpy(elems + first * ch->elem_size, ch->data,
+	       (count - first) * ch->elem_size);
+	ch->head = (ch->head + count) % ch->capacity;
+	ch->count -= count;
+}
+
+/** Wake up to @a count waiters, one per moved element. */
+static void
+coro_chan_wakeup(struct coro_wait_queue *wq, size_t count)
+{
+	for (size_t i = 0; i < count; ++i) {
+		if (coro_wait_queue_wakeup_one(wq) == NULL)
+			break;
+	}
+}
+
+ssize_t
+coro_chan_send_batch(struct coro_chan *ch, const void *elems, size_t count)
+{
+	if (count == 0)
+		return 0;
+	coro_sched_lock();
+	while (ch->count == ch->capacity && ! ch->is_closed)
+		coro_wait_queue_wait(&ch->senders);
+	if (ch->is_closed) {
+		coro_sched_unlock();
+		errno = EPIPE;
+		return -1;
+	}
+	size_t free_count = ch->capacity - ch->count;
+	if (count > free_count)
+		count = free_count;
+	coro_chan_put(ch, elems, count);
+	coro_chan_wakeup(&ch->receivers, count);
+	/* Let the next sender use the rest of the room. */
+	if (ch->count < ch->capacity)
+		coro_wait_queue_wakeup_one(&ch->senders);
+	coro_sched_unlock();
+	return count;
+}
+
+ssize_t
+coro_chan_recv_batch(struct coro_chan *ch, void *elems, size_t count)
+{
+	if (count == 0)
+		return 0;
+	coro_sched_lock();
+	while (ch->count == 0 && ! ch->is_closed)
+		coro_wait_queue_wait(&ch->receivers);
+	if (ch->count == 0) {
+		coro_sched_unlock();
+		errno = EPIPE;
+		return -1;
+	}
+	if (count > ch->count)
+		count = ch->count;
+	coro_chan_take(ch, elems, count);
+	coro_chan_wakeup(&ch->senders, count);
+	/* Let the next receiver take the rest. */
+	if (ch->count > 0)
+		coro_wait_queue_wakeup_one(&ch->receivers);
+	coro_sched_unlock();
+	return count;
+}
+
+int
+coro_chan_send(struct coro_chan *ch, const void *elem)
+{
+	return coro_chan_send_batch(ch, elem, 1) < 0 ? -1 : 0;
+}
+
+int
+coro_chan_recv(struct coro_chan *ch, void *elem)
+{
+	return coro_chan_recv_batch(ch, elem, 1) < 0 ? -1 : 0;
+}
+
+void
+coro_mutex_create(struct coro_mutex *m)
+{
+	m->owner = NULL;
+	coro_wait_queue_create(&m->waiters);
+}
+
+void
+coro_mutex_lock(struct coro_mutex *m)
+{
+	struct coro *c = coro_this_ptr;
+	coro_sched_lock();
+	if (m->owner == NULL)
+		m->owner = c;
+	/* The owner gives the mutex to the waiter right away. */
+	while (m->owner != c)
+		coro_wait_queue_wait(&m->waiters);
+	coro_sched_unlock();
+}
+
+bool
+coro_mutex_trylock(struct coro_mutex *m)
+{
+	bool is_locked = false;
+	coro_sched_lock();
+	if (m->owner == NULL) {
+		m->owner = coro_this_ptr;
+		is_locked = true;
+	}
+	coro_sched_unlock();
+	return is_locked;
+}
+
+void
+coro_mutex_unlock(struct coro_mutex *m)
+{
+	coro_sched_lock();
+	m->owner = coro_wait_queue_wakeup_one(&m->waiters);
+	coro_sched_unlock();
+}
+
+void
+coro_cond_create(struct coro_cond *cond)
+{
+	coro_wait_queue_create(&cond->waiters);
+}
+
+void
+coro_cond_wait(struct coro_cond *cond, struct coro_mutex *m)
+{
+	/*
+	 * Under the scheduler lock a signal can't come between the
+	 * unlock and the wait.
+	 */
+	coro_sched_lock();
+	coro_mutex_unlock(m);
+	coro_wait_queue_wait(&cond->waiters);
+	coro_sched_unlock();
+	coro_mutex_lock(m);
+}
+
+void
+coro_cond_signal(struct coro_cond *cond)
+{
+	coro_wait_queue_wakeup_one(&cond->waiters);
+}
+
+void
+coro_cond_broadcast(struct coro_cond *cond)
+{
+	coro_wait_queue_wakeup_all(&cond->waiters);
+}
+
+/**
+ * Wait until @a is_done in the scheduler context. There is no
+ * coroutine to suspend, so the scheduler is driven right here:
+ * the coroutines run until the condition is met. The finished
+ * ones are kept for coro_sched_wait(). In the multi-threaded
+ * mode the workers run them, and the caller sleeps. Is called
+ * under the scheduler lock.
+ */
+static void
+coro_sched_run_until(bool (*is_done)(void *arg), void *arg)
+{
+	while (! is_done(arg)) {
+		bool is_progress;
+		if (coro_is_mt()) {
+			is_progress = mt.active_count > 0 ||
+				      coro_sched_has_waiters();
+			if (is_progress)
+				pthread_cond_wait(&mt.finish_cond, &mt.lock);
+		} else {
+			is_progress = coro_sched_step();
+		}
+		if (! is_progress) {
+			printf("Critical error - the scheduler waits for "
+			       "the suspended coroutines forever!\n");
+			exit(-1);
+		}
+	}
+}
+
+/**
+ * Wake up the scheduler context, waiting in
+ * coro_sched_run_until(). Only the multi-threaded one sleeps,
+ * the single-threaded one checks the condition after each step.
+ * Is called under the scheduler lock.
+ */
+static inline void
+coro_sched_notify(void)
+{
+	if (coro_is_mt())
+		pthread_cond_broadcast(&mt.finish_cond);
+}
+
+void
+coro_wait_group_create(struct coro_wait_group *wg)
+{
+	wg->count = 0;
+	coro_wait_queue_create(&wg->waiters);
+}
+
+void
+coro_wait_group_add(struct coro_wait_group *wg, int count)
+{
+	coro_sched_lock();
+	wg->count += count;
+	if (wg->count == 0) {
+		coro_wait_queue_wakeup_all(&wg->waiters);
+		coro_sched_notify();
+	}
+	coro_sched_unlock();
+}
+
+void
+coro_wait_group_done(struct coro_wait_group *wg)
+{
+	coro_wait_group_add(wg, -1);
+}
+
+static bool
+coro_wait_group_is_done(void *arg)
+{
+	struct coro_wait_group *wg = arg;
+	return wg->count <= 0;
+}
+
+void
+coro_wait_group_wait(struct coro_wait_group *wg)
+{
+	coro_sched_lock();
+	if (coro_is_sched_context()) {
+		coro_sched_run_until(coro_wait_group_is_done, wg);
+	} else {
+		while (wg->count > 0)
+			coro_wait_queue_wait(&wg->waiters);
+	}
+	coro_sched_unlock();
+}
+
+/** A function call, queued to a coroutine pool. */
+struct coro_pool_job {
+	coro_f func;
+	void *arg;
+	/** Next job in the queue or in the free list. */
+	struct coro_pool_job *next;
+};
+
+struct coro_pool {
+	/** Queued jobs, the oldest first. */
+	struct coro_pool_job *head;
+	struct coro_pool_job *tail;
+	/** Done jobs, cached for the next submits. */
+	struct coro_pool_job *free_jobs;
+	/** Number of queued and running jobs. */
+	int job_count;
+	bool is_closed;
+	/** Idle pool coroutines, waiting for a job. */
+	struct coro_wait_queue workers;
+	/** Who waits for all the jobs to be done. */
+	struct coro_wait_queue waiters;
+};
+
+static int
+coro_pool_worker_f(void *arg)
+{
+	struct coro_pool *pool = arg;
+	int done_count = 0;
+	coro_sched_lock();
+	while (true) {
+		struct coro_pool_job *job = pool->head;
+		if (job == NULL) {
+			if (pool->is_closed)
+				break;
+			coro_wait_queue_wait(&pool->workers);
+			continue;
+		}
+		pool->head = job->next;
+		if (pool->head == NULL)
+			pool->tail = NULL;
+		coro_sched_unlock();
+		job->func(job->arg);
+		++done_count;
+		coro_sched_lock();
+		job->next = pool->free_jobs;
+		pool->free_jobs = job;
+		if (--pool->job_count == 0) {
+			coro_wait_queue_wakeup_all(&pool->waiters);
+			coro_sched_notify();
+		}
+	}
+	coro_sched_unlock();
+	return done_count;
+}
+
+struct coro_pool *
+coro_pool_new(int coro_count)
+{
+	struct coro_pool *pool = malloc(sizeof(*pool));
+	if (pool == NULL)
+		handle_error();
+	pool->head = NULL;
+	pool->tail = NULL;
+	pool->free_jobs = NULL;
+	pool->job_count = 0;
+	pool->is_closed = false;
+	coro_wait_queue_create(&pool->workers);
+	coro_wait_queue_create(&pool->waiters);
+	for (int i = 0; i < coro_count; ++i)
+		coro_new(coro_pool_worker_f, pool);
+	return pool;
+}
+
+void
+coro_pool_delete(struct coro_pool *pool)
+{
+	while (pool->free_jobs != NULL) {
+		struct coro_pool_job *job = pool->free_jobs;
+		pool->free_jobs = job->next;
+		free(job);
+	}
+	free(pool);
+}
+
+void
+coro_pool_submit(struct coro_pool *pool, coro_f func, void *arg)
+{
+	coro_sched_lock();
+	struct coro_pool_job *job = pool->free_jobs;
+	if (job != NULL) {
+		pool->free_jobs = job->next;
+	} else {
+		job = malloc(sizeof(*job));
+		if (job == NULL)
+			handle_error();
+	}
+	job->func = func;
+	job->arg = arg;
+	job->next = NULL;
+	if (pool->tail != NULL)
+		pool->tail->next = job;
+	else
+		pool->head = job;
+	pool->tail = job;
+	++pool->job_count;
+	coro_wait_queue_wakeup_one(&pool->workers);
+	coro_sched_unlock();
+}
+
+static bool
+coro_pool_is_done(void *arg)
+{
+	struct coro_pool *pool = arg;
+	return pool->job_count == 0;
+}
+
+void
+coro_pool_wait(struct coro_pool *pool)
+{
+	coro_sched_lock();
+	if (coro_is_sched_context()) {
+		coro_sched_run_until(coro_pool_is_done, pool);
+	} else {
+		while (pool->job_count > 0)
+			coro_wait_queue_wait(&pool->waiters);
+	}
+	coro_sched_unlock();
+}
+
+void
+coro_pool_close(struct coro_pool *pool)
+{
+	coro_sched_lock();
+	pool->is_closed = true;
+	coro_wait_queue_wakeup_all(&pool->workers);
+	coro_sched_unlock();
+}
+
+/**
+ * Get the state of an fd, growing the table if needed. The table
+ * stores pointers, because the wait queues can't be moved. Is
+ * called under the scheduler lock.
+ */
+static struct coro_fd *
+coro_fd_get(int fd)
+{
+	if (fd >= poller.fd_count) {
+		int new_count = poller.fd_count == 0 ? 64 : poller.fd_count;
+		while (new_count <= fd)
+			new_count *= 2;
+		struct coro_fd **fds = realloc(poller.fds,
+					       new_count * sizeof(*fds));
+		if (fds == NULL)
+			handle_error();
+		memset(fds + poller.fd_count, 0,
+		       (new_count - poller.fd_count) * sizeof(*fds));
+		poller.fds = fds;
+		poller.fd_count = new_count;
+	}
+	struct coro_fd *f = poller.fds[fd];
+	if (f == NULL) {
+		f = malloc(sizeof(*f));
+		if (f == NULL)
+			handle_error();
+		coro_wait_queue_create(&f->readers);
+		coro_wait_queue_create(&f->writers);
+		f->read_events = 0;
+		f->write_events = 0;
+		f->is_registered = false;
+		f->is_nonblock = false;
+		f->is_file = false;
+		poller.fds[fd] = f;
+	}
+	return f;
+}
+
+/** Create the epoll, if not done yet. */
+static void
+coro_poller_create(void)
+{
+	if (poller.epoll_fd >= 0)
+		return;
+	poller.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (poller.epoll_fd < 0)
+		handle_error();
+}
+
+/**
+ * Switch the fd to the non-blocking mode, if not done yet. The
+ * state is returned, it stays in place until the scheduler is
+ * destroyed.
+ */
+static struct coro_fd *
+coro_fd_prepare(int fd)
+{
+	coro_sched_lock();
+	struct coro_fd *f = coro_fd_get(fd);
+	if (! f->is_nonblock) {
+		/*
+		 * Files are always "ready", but io_uring would not
+		 * offload their blocking reads with O_NONBLOCK.
+		 */
+		struct stat st;
+		f->is_file = fstat(fd, &st) == 0 &&
+			     (S_ISREG(st.st_mode) || S_ISBLK(st.st_mode));
+		int flags = fcntl(fd, F_GETFL);
+		if (! f->is_file && flags >= 0 && (flags & O_NONBLOCK) == 0)
+			fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+		f->is_nonblock = true;
+	}
+	coro_sched_unlock();
+	return f;
+}
+
+static inline unsigned
+coro_fd_events(struct coro_fd *f, bool is_write)
+{
+	return __atomic_load_n(is_write ? &f->write_events :
+			       &f->read_events, __ATOMIC_ACQUIRE);
+}
+
+/**
+ * Suspend the current coroutine until the fd becomes readable
+ * or writable. The fd is registered in the epoll once, in the
+ * edge-triggered mode, so the waits after that cost no syscalls.
+ * That is correct as long as the waits happen only after an
+ * operation failed with EAGAIN - then the next readiness is
+ * always a new edge. @a events are the readiness events counter
+ * before the operation.
+ */
+static void
+coro_fd_wait(int fd, bool is_write, unsigned events)
+{
+	coro_sched_lock();
+	struct coro_fd *f = coro_fd_get(fd);
+	if (coro_fd_events(f, is_write) != events) {
+		coro_sched_unlock();
+		return;
+	}
+	if (! f->is_registered) {
+		coro_poller_create();
+		struct epoll_event ev;
+		ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+		ev.data.fd = fd;
+		if (epoll_ctl(poller.epoll_fd, EPOLL_CTL_ADD, fd, &ev) != 0)
+			handle_error();
+		f->is_registered = true;
+	}
+	if (poller.io_wait_count++ == 0)
+		coro_poller_notify();
+	coro_wait_queue_wait(is_write ? &f->writers : &f->readers);
+	--poller.io_wait_count;
+	coro_sched_unlock();
+}
+
+/** Unmap the rings and close the ring fd. */
+static void
+coro_uring_destroy(void)
+{
+	struct coro_uring *u = &poller.uring;
+	if (u->sq_ring != NULL && u->sq_ring != MAP_FAILED)
+		munmap(u->sq_ring, u->sq_ring_size);
+	if (u->cq_ring != NULL && u->cq_ring != MAP_FAILED)
+		munmap(u->cq_ring, u->cq_ring_size);
+	if (u->sqes != NULL && u->sqes != MAP_FAILED)
+		munmap(u->sqes, u->sqes_size);
+	if (u->fd >= 0)
+		close(u->fd);
+	u->sq_ring = NULL;
+	u->cq_ring = NULL;
+	u->sqes = NULL;
+	u->fd = -1;
+}
+
+/**
+ * Create the io_uring and add it to the epoll, if not done yet.
+ * If the kernel does not allow that, the file I/O falls back to
+ * the blocking calls. Is called under the scheduler lock.
+ */
+static void
+coro_uring_create(void)
+{
+	struct coro_uring *u = &poller.uring;
+	if (u->fd >= 0 || u->is_unavailable)
+		return;
+	struct io_uring_params params;
+	memset(&params, 0, sizeof(params));
+	u->fd = syscall(__NR_io_uring_setup, CORO_URING_ENTRIES, &params);
+	if (u->fd < 0) {
+		/* ENOSYS, or forbidden by seccomp or by sysctl. */
+		u->is_unavailable = true;
+		return;
+	}
+	u->sq_ring_size = params.sq_off.array +
+			  params.sq_entries * sizeof(unsigned);
+	u->cq_ring_size = params.cq_off.cqes +
+			  params.cq_entries * sizeof(struct io_uring_cqe);
+	u->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+	int prot = PROT_READ | PROT_WRITE;
+	int flags = MAP_SHARED | MAP_POPULATE;
+	u->sq_ring = mmap(NULL, u->sq_ring_size, prot, flags, u->fd,
+			  IORING_OFF_SQ_RING);
+	u->cq_ring = mmap(NULL, u->cq_ring_size, prot, flags, u->fd,
+			  IORING_OFF_CQ_RING);
+	u->sqes = mmap(NULL, u->sqes_size, prot, flags, u->fd,
+		       IORING_OFF_SQES);
+	if (u->sq_ring == MAP_FAILED || u->cq_ring == MAP_FAILED ||
+	    u->sqes == MAP_FAILED) {
+		coro_uring_destroy();
+		u->is_unavailable = true;
+		return;
+	}
+	char *sq = u->sq_ring, *cq = u->cq_ring;
+	u->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+	u->sq_mask = *(unsigned *)(sq + params.sq_off.ring_mask);
+	u->sq_array = (unsigned *)(sq + params.sq_off.array);
+	u->cq_head = (unsigned *)(cq + params.cq_off.head);
+	u->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+	u->cq_mask = *(unsigned *)(cq + params.cq_off.ring_mask);
+	u->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+	u->entries = params.sq_entries;
+	u->inflight = 0;
+	u->has_cur_pos = (params.features & IORING_FEAT_RW_CUR_POS) != 0;
+	coro_wait_queue_create(&u->waiters);
+	coro_poller_create();
+	struct epoll_event ev;
+	ev.events = EPOLLIN;
+	ev.data.fd = u->fd;
+	if (epoll_ctl(poller.epoll_fd, EPOLL_CTL_ADD, u->fd, &ev) != 0)
+		handle_error();
+}
+
+/** A file operation, submitted to io_uring. */
+struct coro_uring_req {
+	struct iovec iov;
+	/** Result, the same as of the syscall, or -errno. */
+	int res;
+	bool is_done;
+	/** The coroutine which waits for the result. */
+	struct coro_wait_queue waiter;
+};
+
+/**
+ * Take all the completions from the ring and wake up their
+ * coroutines. Is called under the scheduler lock.
+ */
+static void
+coro_uring_harvest(void)
+{
+	struct coro_uring *u = &poller.uring;
+	unsigned head = *u->cq_head;
+	unsigned tail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+	if (head == tail)
+		return;
+	for (; head != tail; ++head) {
+		struct io_uring_cqe *cqe = &u->cqes[head & u->cq_mask];
+		struct coro_uring_req *req =
+			(struct coro_uring_req *)(uintptr_t)cqe->user_data;
+		req->res = cqe->res;
+		req->is_done = true;
+		coro_wait_queue_wakeup_one(&req->waiter);
+		--u->inflight;
+	}
+	__atomic_store_n(u->cq_head, tail, __ATOMIC_RELEASE);
+	coro_wait_queue_wakeup_all(&u->waiters);
+}
+
+/**
+ * Do a file read or write via io_uring: submit it and suspend
+ * until the poller gets its completion. Returns false if
+ * io_uring is not available, then the caller should do the
+ * operation itself.
+ */
+static bool
+coro_uring_rw(int opcode, int fd, void *buf, size_t size, off_t offset,
+	      ssize_t *res)
+{
+	struct coro_uring *u = &poller.uring;
+	coro_sched_lock();
+	coro_uring_create();
+	if (u->fd < 0 || (offset == -1 && ! u->has_cur_pos)) {
+		coro_sched_unlock();
+		return false;
+	}
+	while (u->inflight == u->entries)
+		coro_wait_queue_wait(&u->waiters);
+	/*
+	 * The harvest writes into the request when the coroutine
+	 * may be off the shared stack, so it is not on the stack.
+	 */
+	struct coro_uring_req *req = malloc(sizeof(*req));
+	if (req == NULL)
+		handle_error();
+	req->iov.iov_base = buf;
+	req->iov.iov_len = size;
+	req->is_done = false;
+	coro_wait_queue_create(&req->waiter);
+	/* READV and WRITEV work on all the kernels with io_uring. */
+	unsigned tail = *u->sq_tail;
+	unsigned idx = tail & u->sq_mask;
+	struct io_uring_sqe *sqe = &u->sqes[idx];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = opcode;
+	sqe->fd = fd;
+	sqe->addr = (uintptr_t)&req->iov;
+	sqe->len = 1;
+	sqe->off = offset;
+	sqe->user_data = (uintptr_t)req;
+	u->sq_array[idx] = idx;
+	__atomic_store_n(u->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	++u->inflight;
+	int rc;
+	do {
+		rc = syscall(__NR_io_uring_enter, u->fd, 1, 0, 0, NULL, 0);
+	} while (rc < 0 && errno == EINTR);
+	if (rc < 0)
+		handle_error();
+	/* Cached data is often read right in the submit. */
+	coro_uring_harvest();
+	if (! req->is_done) {
+		if (poller.io_wait_count++ == 0)
+			coro_poller_notify();
+		while (! req->is_done)
+			coro_wait_queue_wait(&req->waiter);
+		--poller.io_wait_count;
+	}
+	coro_sched_unlock();
+	int result = req->res;
+	free(req);
+	if (result < 0) {
+		errno = -result;
+		*res = -1;
+	} else {
+		*res = result;
+	}
+	return true;
+}
+
+/** A blocking call, run by a helper thread. */
+struct coro_offload_job {
+	coro_f func;
+	void *arg;
+	/** Result of func and errno after it. */
+	int res;
+	int err;
+	bool is_done;
+	/** The coroutine which waits for the result. */
+	struct coro_wait_queue waiter;
+	/** Next job in the queue or in the done list. */
+	struct coro_offload_job *next;
+};
+
+static void *
+coro_offload_thread_f(void *arg)
+{
+	(void)arg;
+	/* The signals are for the scheduler threads. */
+	sigset_t all;
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, NULL);
+	pthread_mutex_lock(&offload.lock);
+	while (true) {
+		struct coro_offload_job *job = offload.head;
+		if (job == NULL) {
+			if (offload.is_shutdown)
+				break;
+			pthread_cond_wait(&offload.cond, &offload.lock);
+			continue;
+		}
+		offload.head = job->next;
+		if (offload.head == NULL)
+			offload.tail = NULL;
+		pthread_mutex_unlock(&offload.lock);
+		job->res = job->func(job->arg);
+		job->err = errno;
+		pthread_mutex_lock(&offload.lock);
+		job->next = offload.done;
+		offload.done = job;
+		uint64_t one = 1;
+		if (write(offload.event_fd, &one, sizeof(one)) < 0 &&
+		    errno != EAGAIN)
+			handle_error();
+	}
+	pthread_mutex_unlock(&offload.lock);
+	return NULL;
+}
+
+/**
+ * Start the helper threads, if not done yet. Is called under the
+ * scheduler lock.
+ */
+static void
+coro_offload_start(void)
+{
+	if (offload.thread_count > 0)
+		return;
+	coro_poller_create();
+	offload.event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (offload.event_fd < 0)
+		handle_error();
+	struct epoll_event ev;
+	ev.events = EPOLLIN;
+	ev.data.fd = offload.event_fd;
+	if (epoll_ctl(poller.epoll_fd, EPOLL_CTL_ADD, offload.event_fd,
+		      &ev) != 0)
+		handle_error();
+	offload.is_shutdown = false;
+	for (int i = 0; i < CORO_OFFLOAD_THREAD_COUNT; ++i) {
+		errno = pthread_create(&offload.threads[i], NULL,
+				       coro_offload_thread_f, NULL);
+		if (errno != 0)
+			handle_error();
+	}
+	offload.thread_count = CORO_OFFLOAD_THREAD_COUNT;
+}
+
+static void
+coro_offload_stop(void)
+{
+	if (offload.thread_count == 0)
+		return;
+	pthread_mutex_lock(&offload.lock);
+	offload.is_shutdown = true;
+	pthread_cond_broadcast(&offload.cond);
+	pthread_mutex_unlock(&offload.lock);
+	for (int i = 0; i < offload.thread_count; ++i)
+		pthread_join(offload.threads[i], NULL);
+	offload.thread_count = 0;
+	close(offload.event_fd);
+	offload.event_fd = -1;
+}
+
+/**
+ * Wake up the coroutines whose calls are done. Is called by the
+ * poller under the scheduler lock.
+ */
+static void
+coro_offload_harvest(void)
+{
+	uint64_t value;
+	if (read(offload.event_fd, &value, sizeof(value)) < 0 &&
+	    errno != EAGAIN)
+		handle_error();
+	pthread_mutex_lock(&offload.lock);
+	struct coro_offload_job *job = offload.done;
+	offload.done = NULL;
+	pthread_mutex_unlock(&offload.lock);
+	while (job != NULL) {
+		struct coro_offload_job *next = job->next;
+		job->is_done = true;
+		coro_wait_queue_wakeup_one(&job->waiter);
+		job = next;
+	}
+}
+
+int
+coro_offload(coro_f func, void *arg)
+{
+	if (coro_is_on_shared_stack(arg)) {
+		printf("Critical error - coro_offload() argument is on "
+		       "the shared stack!\n");
+		exit(-1);
+	}
+	/* Not on the stack, it can be shared. */
+	struct coro_offload_job *job = malloc(sizeof(*job));
+	if (job == NULL)
+		handle_error();
+	job->func = func;
+	job->arg = arg;
+	job->is_done = false;
+	job->next = NULL;
+	coro_wait_queue_create(&job->waiter);
+	coro_sched_lock();
+	coro_offload_start();
+	pthread_mutex_lock(&offload.lock);
+	if (offload.tail != NULL)
+		offload.tail->next = job;
+	else
+		offload.head = job;
+	offload.tail = job;
+	pthread_cond_signal(&offload.cond);
+	pthread_mutex_unlock(&offload.lock);
+	/* The scheduler polls while there are waiters. */
+	if (poller.io_wait_count++ == 0)
+		coro_poller_notify();
+	while (! job->is_done)
+		coro_wait_queue_wait(&job->waiter);
+	--poller.io_wait_count;
+	coro_sched_unlock();
+	int res = job->res;
+	int err = job->err;
+	free(job);
+	errno = err;
+	return res;
+}
+
+/**
+ * Make sure the scheduler has the eventfd, which the remote
+ * wakeups kick.
+ */
+static void
+coro_remote_start(void)
+{
+	if (poller.event_fd >= 0)
+		return;
+	coro_poller_create();
+	int fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (fd < 0)
+		handle_error();
+	struct epoll_event ev;
+	ev.events = EPOLLIN;
+	ev.data.fd = fd;
+	if (epoll_ctl(poller.epoll_fd, EPOLL_CTL_ADD, fd, &ev) != 0)
+		handle_error();
+	/*
+	 * A remote thread pushes and then reads the fd, the
+	 * scheduler stores the fd and then takes the inbox. Either
+	 * the thread sees the fd and kicks, or the push is seen.
+	 */
+	__atomic_store_n(&poller.event_fd, fd, __ATOMIC_SEQ_CST);
+}
+
+/** Wake up the coroutines from the remote inbox. */
+static void
+coro_remote_harvest(void)
+{
+	if (__atomic_load_n(&remote_inbox, __ATOMIC_RELAXED) == NULL)
+		return;
+	struct coro *c = __atomic_exchange_n(&remote_inbox, NULL,
+					     __ATOMIC_SEQ_CST);
+	/* The stack is in reverse order, make it FIFO. */
+	struct coro *fifo = NULL;
+	while (c != NULL) {
+		struct coro *next = c->remote_next;
+		c->remote_next = fifo;
+		fifo = c;
+		c = next;
+	}
+	while (fifo != NULL) {
+		struct coro *next = fifo->remote_next;
+		__atomic_store_n(&fifo->is_remote_queued, false,
+				 __ATOMIC_RELEASE);
+		coro_wakeup(fifo);
+		fifo = next;
+	}
+}
+
+void
+coro_wakeup_remote(struct coro *c)
+{
+	/* Already queued, it will be woken up anyway. */
+	if (__atomic_exchange_n(&c->is_remote_queued, true,
+				__ATOMIC_ACQ_REL))
+		return;
+	struct coro *head = __atomic_load_n(&remote_inbox, __ATOMIC_RELAXED);
+	do {
+		c->remote_next = head;
+	} while (! __atomic_compare_exchange_n(&remote_inbox, &head, c, true,
+					       __ATOMIC_SEQ_CST,
+					       __ATOMIC_RELAXED));
+	/* Only the first one kicks, the rest are taken with it. */
+	if (head != NULL)
+		return;
+	int fd = __atomic_load_n(&poller.event_fd, __ATOMIC_SEQ_CST);
+	if (fd < 0)
+		return;
+	uint64_t one = 1;
+	if (write(fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+		handle_error();
+}
+
+void
+coro_suspend_remote(void)
+{
+	coro_sched_lock();
+	coro_remote_start();
+	/* The wakeup could come before, then it is pending. */
+	coro_remote_harvest();
+	/* The scheduler polls while there are waiters. */
+	if (poller.io_wait_count++ == 0)
+		coro_poller_notify();
+	coro_suspend();
+	--poller.io_wait_count;
+	coro_sched_unlock();
+}
+
+/**
+ * Wait for I/O events for @a timeout nanoseconds, -1 means
+ * infinity, and wake up the coroutines whose fds are ready.
+ * Without fds it is just a sleep. Is called without the
+ * scheduler lock, so the other workers can work meanwhile.
+ */
+static void
+coro_sched_poll(int64_t timeout)
+{
+	sched->yields_since_poll = 0;
+	struct timespec ts;
+	ts.tv_sec = timeout / 1000000000;
+	ts.tv_nsec = timeout % 1000000000;
+	if (poller.epoll_fd < 0) {
+		if (timeout > 0)
+			nanosleep(&ts, NULL);
+		return;
+	}
+	struct epoll_event events[CORO_POLL_EVENT_COUNT];
+	int count = epoll_pwait2(poller.epoll_fd, events,
+				 CORO_POLL_EVENT_COUNT,
+				 timeout >= 0 ? &ts : NULL, NULL);
+	if (count < 0 && errno == ENOSYS) {
+		/* Old kernel, only millisecond precision. */
+		int ms = timeout < 0 ? -1 : (timeout + 999999) / 1000000;
+		count = epoll_wait(poller.epoll_fd, events,
+				   CORO_POLL_EVENT_COUNT, ms);
+	}
+	if (count < 0) {
+		if (errno == EINTR)
+			return;
+		handle_error();
+	}
+	coro_sched_lock();
+	for (int i = 0; i < count; ++i) {
+		uint32_t e = events[i].events;
+		int fd = events[i].data.fd;
+		if (fd == poller.event_fd) {
+			uint64_t value;
+			if (read(fd, &value, sizeof(value)) < 0 &&
+			    errno != EAGAIN)
+				handle_error();
+			continue;
+		}
+		if (fd == poller.uring.fd) {
+			coro_uring_harvest();
+			continue;
+		}
+		if (fd == offload.event_fd) {
+			coro_offload_harvest();
+			continue;
+		}
+		struct coro_fd *f = poller.fds[fd];
+		if ((e & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) != 0) {
+			__atomic_add_fetch(&f->read_events, 1,
+					   __ATOMIC_RELEASE);
+			coro_wait_queue_wakeup_all(&f->readers);
+		}
+		if ((e & (EPOLLOUT | EPOLLHUP | EPOLLERR)) != 0) {
+			__atomic_add_fetch(&f->write_events, 1,
+					   __ATOMIC_RELEASE);
+			coro_wait_queue_wakeup_all(&f->writers);
+		}
+	}
+	coro_remote_harvest();
+	coro_sched_unlock();
+}
+
+static inline bool
+coro_errno_is_would_block(void)
+{
+	return errno == EAGAIN || errno == EWOULDBLOCK;
+}
+
+/** A file operation, offloaded to a helper thread. */
+struct coro_file_op {
+	int fd;
+	void *buf;
+	size_t size;
+	/** -1 means the current file position. */
+	off_t offset;
+	bool is_write;
+	ssize_t res;
+};
+
+static int
+coro_file_op_f(void *arg)
+{
+	struct coro_file_op *op = arg;
+	if (op->is_write && op->offset == -1)
+		op->res = write(op->fd, op->buf, op->size);
+	else if (op->is_write)
+		op->res = pwrite(op->fd, op->buf, op->size, op->offset);
+	else if (op->offset == -1)
+		op->res = read(op->fd, op->buf, op->size);
+	else
+		op->res = pread(op->fd, op->buf, op->size, op->offset);
+	return 0;
+}
+
+/**
+ * Read or write a file via io_uring. If it is not available,
+ * the blocking call is offloaded to a helper thread.
+ */
+static ssize_t
+coro_file_rw(int fd, void *buf, size_t size, off_t offset, bool is_write)
+{
+	/*
+	 * The kernel or a helper thread would write into the buffer
+	 * while another coroutine could own the shared stack.
+	 */
+	void *bounce = NULL;
+	void *io_buf = buf;
+	if (coro_is_on_shared_stack(buf)) {
+		bounce = malloc(size);
+		if (bounce == NULL)
+			handle_error();
+		if (is_write)
+			memcpy(bounce, buf, size);
+		io_buf = bounce;
+	}
+	ssize_t rc;
+	if (! coro_uring_rw(is_write ? IORING_OP_WRITEV : IORING_OP_READV,
+			    fd, io_buf, size, offset, &rc)) {
+		struct coro_file_op *op = malloc(sizeof(*op));
+		if (op == NULL)
+			handle_error();
+		*op = (struct coro_file_op){fd, io_buf, size, offset,
+					    is_write, -1};
+		coro_offload(coro_file_op_f, op);
+		rc = op->res;
+		free(op);
+	}
+	if (bounce != NULL) {
+		int err = errno;
+		if (! is_write && rc > 0)
+			memcpy(buf, bounce, rc);
+		free(bounce);
+		errno = err;
+	}
+	return rc;
+}
+
+ssize_t
+coro_read(int fd, void *buf, size_t size)
+{
+	struct coro_fd *f = coro_fd_prepare(fd);
+	if (f->is_file)
+		return coro_file_rw(fd, buf, size, -1, false);
+	while (true) {
+		unsigned events = coro_fd_events(f, false);
+		ssize_t rc = read(fd, buf, size);
+		if (rc >= 0)
+			return rc;
+		if (coro_errno_is_would_block())
+			coro_fd_wait(fd, false, events);
+		else if (errno != EINTR)
+			return -1;
+	}
+}
+
+ssize_t
+coro_write(int fd, const void *buf, size_t size)
+{
+	struct coro_fd *f = coro_fd_prepare(fd);
+	if (f->is_file)
+		return coro_file_rw(fd, (void *)buf, size, -1, true);
+	while (true) {
+		unsigned events = coro_fd_events(f, true);
+		ssize_t rc = write(fd, buf, size);
+		if (rc >= 0)
+			return rc;
+		if (coro_errno_is_would_block())
+			coro_fd_wait(fd, true, events);
+		else if (errno != EINTR)
+			return -1;
+	}
+}
+
+ssize_t
+coro_pread(int fd, void *buf, size_t size, off_t offset)
+{
+	return coro_file_rw(fd, buf, size, offset, false);
+}
+
+ssize_t
+coro_pwrite(int fd, const void *buf, size_t size, off_t offset)
+{
+	return coro_file_rw(fd, (void *)buf, size, offset, true);
+}
+
+int
+coro_accept(int fd, struct sockaddr *addr, socklen_t *addr_len)
+{
+	struct coro_fd *f = coro_fd_prepare(fd);
+	while (true) {
+		unsigned events = coro_fd_events(f, false);
+		int rc = accept4(fd, addr, addr_len,
+				 SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (rc >= 0) {
+			/*
+			 * The number could belong to a closed fd,
+			 * whose state is stale.
+			 */
+			coro_sched_lock();
+			struct coro_fd *new_f = coro_fd_get(rc);
+			new_f->is_registered = false;
+			new_f->is_nonblock = true;
+			new_f->is_file = false;
+			coro_sched_unlock();
+			return rc;
+		}
+		if (coro_errno_is_would_block())
+			coro_fd_wait(fd, false, events);
+		else if (errno != EINTR && errno != ECONNABORTED)
+			return -1;
+	}
+}
+
+int
+coro_connect(int fd, const struct sockaddr *addr, socklen_t addr_len)
+{
+	struct coro_fd *f = coro_fd_prepare(fd);
+	if (connect(fd, addr, addr_len) == 0)
+		return 0;
+	if (errno != EINPROGRESS)
+		return -1;
+	struct pollfd pfd;
+	pfd.fd = fd;
+	pfd.events = POLLOUT;
+	/* A wakeup could come not from the socket. */
+	while (true) {
+		unsigned events = coro_fd_events(f, true);
+		if (poll(&pfd, 1, 0) != 0)
+			break;
+		coro_fd_wait(fd, true, events);
+	}
+	int err;
+	socklen_t err_len = sizeof(err);
+	if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &err_len) != 0)
+		return -1;
+	if (err != 0) {
+		errno = err;
+		return -1;
+	}
+	return 0;
+}
+
+int
+coro_close(int fd)
+{
+	coro_sched_lock();
+	if (fd >= 0 && fd < poller.fd_count && poller.fds[fd] != NULL) {
+		struct coro_fd *f = poller.fds[fd];
+		coro_wait_queue_wakeup_all(&f->readers);
+		coro_wait_queue_wakeup_all(&f->writers);
+		f->is_registered = false;
+		f->is_nonblock = false;
+		f->is_file = false;
+	}
+	int rc = close(fd);
+	coro_sched_unlock();
+	return rc;
+}
+
+/** Prepare an empty scheduler. */
+static void
+coro_sched_create(struct coro_sched *s)
+{
+	memset(&s->main, 0, sizeof(s->main));
+	s->main.state = CORO_STATE_RUNNING;
+	coro_ready_queue_create(&s->ready);
+	rlist_create(&s->blocked);
+	rlist_create(&s->finished);
+	s->is_waiting = false;
+	s->yields_since_poll = 0;
+	s->coro_count = 0;
+	s->target_latency = 0;
+	s->quantum = 0;
+	s->stack_pool.hits = 0;
+	s->stack_pool.misses = 0;
+	s->shared_stack = NULL;
+	s->shared_owner = NULL;
+	s->has_preempt_timer = false;
+	s->is_preempt_pending = 0;
+}
+
+/** Make the scheduler the one of the current thread. */
+static void
+coro_sched_enter(struct coro_sched *s)
+{
+	s->main.run_start = coro_cycles();
+	sched = s;
+	coro_this_ptr = &s->main;
+}
+
+/** Run a coroutine which has switched to the worker loop. */
+static void
+coro_worker_post(struct coro_sched *w)
+{
+	struct coro *c = w->post_coro;
+	switch (w->post) {
+	case CORO_POST_READY:
+		coro_worker_push(w, c, true);
+		break;
+	case CORO_POST_SUSPEND:
+		pthread_mutex_unlock(&mt.lock);
+		break;
+	case CORO_POST_FINISH:
+		coro_sched_lock();
+		rlist_add_tail(&sched_main.finished, &c->in_sched);
+		--sched_main.coro_count;
+		--mt.active_count;
+		coro_sched_update_quantum();
+		pthread_cond_signal(&mt.finish_cond);
+		coro_sched_unlock();
+		break;
+	}
+}
+
+/**
+ * Find a coroutine to run: first in the own queue, then in the
+ * queues of the other workers. A thief takes a half of the
+ * victim's queue, so the work spreads fast.
+ */
+static struct coro *
+coro_worker_next(struct coro_sched *w)
+{
+	struct coro *c = coro_worker_pop(w);
+	if (c != NULL)
+		return c;
+	int self = w - mt.workers;
+	for (int i = 1; i < mt.thread_count; ++i) {
+		struct coro_sched *victim =
+			&mt.workers[(self + i) % mt.thread_count];
+		if (__atomic_load_n(&victim->ready_count,
+				    __ATOMIC_SEQ_CST) == 0)
+			continue;
+		struct rlist stolen;
+		rlist_create(&stolen);
+		int count = 0;
+		pthread_spin_lock(&victim->ready_lock);
+		int total = victim->ready_count;
+		/* The most important ones are stolen first. */
+		while (count < (total + 1) / 2) {
+			c = coro_ready_queue_pop(&victim->ready);
+			rlist_add_tail(&stolen, &c->in_sched);
+			++count;
+		}
+		__atomic_sub_fetch(&victim->ready_count, count,
+				   __ATOMIC_RELAXED);
+		pthread_spin_unlock(&victim->ready_lock);
+		if (count == 0)
+			continue;
+		c = rlist_shift_entry(&stolen, struct coro, in_sched);
+		if (--count == 0)
+			return c;
+		pthread_spin_lock(&w->ready_lock);
+		while (! rlist_empty(&stolen)) {
+			coro_ready_queue_push(&w->ready,
+					      rlist_shift_entry(&stolen,
+								struct coro,
+								in_sched),
+					      true);
+		}
+		__atomic_add_fetch(&w->ready_count, count,
+				   __ATOMIC_SEQ_CST);
+		pthread_spin_unlock(&w->ready_lock);
+		return c;
+	}
+	return NULL;
+}
+
+/** True, if any worker has ready coroutines. */
+static bool
+coro_worker_has_work(void)
+{
+	for (int i = 0; i < mt.thread_count; ++i) {
+		if (__atomic_load_n(&mt.workers[i].ready_count,
+				    __ATOMIC_SEQ_CST) != 0)
+			return true;
+	}
+	return false;
+}
+
+/**
+ * Poll the I/O and timers, unless another worker does that. Is
+ * called under the scheduler lock, which is released during the
+ * poll.
+ */
+static void
+coro_worker_poll(int64_t timeout)
+{
+	if (poller.is_polling)
+		return;
+	poller.is_polling = true;
+	int64_t next = coro_sched_process_timers();
+	if (timeout < 0 || (next >= 0 && next < timeout))
+		timeout = next;
+	if (coro_worker_has_work())
+		timeout = 0;
+	coro_sched_unlock();
+	coro_sched_poll(timeout);
+	coro_sched_process_timers();
+	coro_sched_lock();
+	poller.is_polling = false;
+	/* Hand the polling over, this worker has work now. */
+	if (coro_sched_has_waiters() && mt.sleeping_count > 0)
+		pthread_cond_signal(&mt.idle_cond);
+}
+
+/**
+ * Nothing to run. Poll for I/O and timers if somebody waits for
+ * them, or sleep until new coroutines are ready.
+ * @retval false The worker should exit.
+ */
+static bool
+coro_worker_idle(void)
+{
+	coro_sched_lock();
+	if (mt.is_shutdown) {
+		coro_sched_unlock();
+		return false;
+	}
+	__atomic_add_fetch(&mt.idle_count, 1, __ATOMIC_SEQ_CST);
+	if (! coro_worker_has_work()) {
+		if (coro_sched_has_waiters() && ! poller.is_polling) {
+			coro_worker_poll(-1);
+		} else {
+			++mt.sleeping_count;
+			pthread_cond_wait(&mt.idle_cond, &mt.lock);
+			--mt.sleeping_count;
+		}
+	}
+	__atomic_sub_fetch(&mt.idle_count, 1, __ATOMIC_SEQ_CST);
+	coro_sched_unlock();
+	return true;
+}
+
+/** Body of a worker thread. */
+static void *
+coro_worker_f(void *arg)
+{
+	struct coro_sched *w = arg;
+	coro_sched_enter(w);
+	coro_preempt_timer_create(w);
+	while (true) {
+		struct coro *c = w->handoff;
+		if (c != NULL)
+			w->handoff = NULL;
+		else
+			c = coro_worker_next(w);
+		if (c == NULL) {
+			if (! coro_worker_idle())
+				break;
+			continue;
+		}
+		coro_switch_to(c);
+		coro_worker_post(w);
+		/* Busy workers check the poller from time to time. */
+		if (++w->yields_since_poll >= CORO_POLL_YIELD_INTERVAL) {
+			w->yields_since_poll = 0;
+			if (coro_sched_has_waiters()) {
+				coro_sched_lock();
+				coro_worker_poll(0);
+				coro_sched_unlock();
+			}
+		}
+	}
+	coro_preempt_timer_delete(w);
+	coro_stack_pool_trim(&w->stack_pool, 0);
+	return NULL;
+}
+
+static void
+coro_sched_start_workers(int thread_count)
+{
+	coro_poller_create();
+	poller.event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (poller.event_fd < 0)
+		handle_error();
+	struct epoll_event ev;
+	ev.events = EPOLLIN;
+	ev.data.fd = poller.event_fd;
+	if (epoll_ctl(poller.epoll_fd, EPOLL_CTL_ADD, poller.event_fd,
+		      &ev) != 0)
+		handle_error();
+	mt.workers = calloc(thread_count, sizeof(*mt.workers));
+	if (mt.workers == NULL)
+		handle_error();
+	mt.idle_count = 0;
+	mt.sleeping_count = 0;
+	mt.active_count = 0;
+	mt.next_worker = 0;
+	mt.is_shutdown = false;
+	mt.thread_count = thread_count;
+	/* The workers look into the queues of each other. */
+	for (int i = 0; i < thread_count; ++i) {
+		struct coro_sched *w = &mt.workers[i];
+		coro_sched_create(w);
+		w->stack_pool.max_size = sched_main.stack_pool.max_size;
+		if (pthread_spin_init(&w->ready_lock,
+				      PTHREAD_PROCESS_PRIVATE) != 0)
+			handle_error();
+	}
+	for (int i = 0; i < thread_count; ++i) {
+		struct coro_sched *w = &mt.workers[i];
+		errno = pthread_create(&w->thread, NULL, coro_worker_f, w);
+		if (errno != 0)
+			handle_error();
+	}
+}
+
+static void
+coro_sched_stop_workers(void)
+{
+	coro_sched_lock();
+	mt.is_shutdown = true;
+	pthread_cond_broadcast(&mt.idle_cond);
+	if (poller.is_polling)
+		coro_poller_kick();
+	coro_sched_unlock();
+	for (int i = 0; i < mt.thread_count; ++i) {
+		pthread_join(mt.workers[i].thread, NULL);
+		pthread_spin_destroy(&mt.workers[i].ready_lock);
+	}
+	mt.thread_count = 0;
+	free(mt.workers);
+	mt.workers = NULL;
+	close(poller.event_fd);
+	poller.event_fd = -1;
+}
+
+void
+coro_sched_init(void)
+{
+	is_stack_check_forced = getenv("LIBCORO_STACK_CHECK") != NULL;
+	const char *uring = getenv("LIBCORO_IO_URING");
+	poller.uring.is_unavailable = uring != NULL && strcmp(uring, "0") == 0;
+	const char *preempt = getenv("LIBCORO_PREEMPT_US");
+	if (preempt != NULL)
+		preempt_slice_ns = strtoull(preempt, NULL, 10) * 1000;
+	const char *env = getenv("LIBCORO_THREADS");
+	coro_sched_init_mt(env != NULL ? atoi(env) : 0);
+}
+
+void
+coro_sched_init_mt(int thread_count)
+{
+	coro_cycles_calibrate();
+	coro_long_slice_update();
+	coro_sched_create(&sched_main);
+	coro_sched_enter(&sched_main);
+	coro_preempt_start();
+	poller.io_wait_count = 0;
+	poller.timer_count = 0;
+	poller.is_polling = false;
+	if (thread_count > 0)
+		coro_sched_start_workers(thread_count);
+	else
+		coro_preempt_timer_create(&sched_main);
+}
+
+static void
+coro_pt_runner_destroy(void);
+
+void
+coro_sched_destroy(void)
+{
+	if (coro_is_mt())
+		coro_sched_stop_workers();
+	coro_preempt_timer_delete(&sched_main);
+	preempt_slice_cycles = 0;
+	coro_pt_runner_destroy();
+	coro_stack_pool_trim(&sched_main.stack_pool, 0);
+	coro_shared_stack_destroy(&sched_main);
+	free(sched_main.main.local_slow);
+	sched_main.main.local_slow = NULL;
+	sched_main.main.local_slow_size = 0;
+	for (int i = 0; i < poller.fd_count; ++i)
+		free(poller.fds[i]);
+	free(poller.fds);
+	poller.fds = NULL;
+	poller.fd_count = 0;
+	if (poller.epoll_fd >= 0) {
+		close(poller.epoll_fd);
+		poller.epoll_fd = -1;
+	}
+	if (poller.event_fd >= 0) {
+		close(poller.event_fd);
+		poller.event_fd = -1;
+	}
+	remote_inbox = NULL;
+	free(poller.timers);
+	poller.timers = NULL;
+	poller.timer_capacity = 0;
+	coro_uring_destroy();
+	poller.uring.is_unavailable = false;
+	coro_offload_stop();
+}
+
+/**
+ * In the multi-threaded mode the coroutines are run by the
+ * workers, the caller only sleeps until one finishes.
+ */
+static struct coro *
+coro_sched_wait_mt(void)
+{
+	struct coro *c = NULL;
+	coro_sched_lock();
+	while (rlist_empty(&sched_main.finished)) {
+		/* Nothing can wake the suspended ones up. */
+		if (mt.active_count == 0 && ! coro_sched_has_waiters())
+			goto out;
+		pthread_cond_wait(&mt.finish_cond, &mt.lock);
+	}
+	c = rlist_shift_entry(&sched_main.finished, struct coro, in_sched);
+out:
+	coro_sched_unlock();
+	return c;
+}
+
+/**
+ * Make one step of the single-threaded scheduler: run the next
+ * ready coroutine, or sleep until an fd or a timer wakes some up.
+ * Returns false, if nothing can wake the suspended ones up.
+ */
+static bool
+coro_sched_step(void)
+{
+	if (coro_ready_queue_is_empty(&sched->ready)) {
+		if (! coro_sched_has_waiters())
+			return false;
+		/* Sleep until an fd or the closest deadline. */
+		int64_t timeout = coro_sched_process_timers();
+		if (coro_ready_queue_is_empty(&sched->ready))
+			coro_sched_poll(timeout);
+		coro_sched_process_timers();
+		return true;
+	}
+	struct coro *c = coro_ready_queue_pop(&sched->ready);
+	sched->is_waiting = true;
+	coro_switch_to(c);
+	sched->is_waiting = false;
+	return true;
+}
+
+struct coro *
+coro_sched_wait(void)
+{
+	if (coro_is_mt())
+		return coro_sched_wait_mt();
+	while (rlist_empty(&sched->finished)) {
+		if (! coro_sched_step())
+			return NULL;
+	}
+	return rlist_shift_entry(&sched->finished, struct coro, in_sched);
+}
+
+struct coro *
+coro_this(void)
+{
+	return coro_this_ptr;
+}
+
+void
+coro_set_name(struct coro *c, const char *name)
+{
+	snprintf(c->name, sizeof(c->name), "%s", name);
+}
+
+const char *
+coro_name(const struct coro *c)
+{
+	return c->name;
+}
+
+void
+coro_sched_dump(int fd)
+{
+	static const char *state_names[] = {
+		[CORO_STATE_READY] = "ready",
+		[CORO_STATE_RUNNING] = "running",
+		[CORO_STATE_SUSPENDED] = "suspended",
+		[CORO_STATE_FINISHED] = "finished",
+	};
+	coro_sched_lock();
+	dprintf(fd, "coroutines: %d not finished, %lld preemptions\n",
+		sched_main.coro_count, coro_sched_preempt_count());
+	struct rlist *item;
+	for (item = all_coros.next; item != &all_coros; item = item->next) {
+		struct coro *c = rlist_entry(item, struct coro, in_all);
+		dprintf(fd, "%p %-16s %-9s switches %lld run %llu us "
+			"max slice %llu us stack %zu/%zu\n", (void *)c,
+			c->name[0] != 0 ? c->name : "-",
+			state_names[c->state], c->switch_count,
+			(unsigned long long)coro_run_time(c) / 1000,
+			(unsigned long long)coro_max_run_time(c) / 1000,
+			coro_stack_used(c), c->stack_size);
+	}
+	coro_sched_unlock();
+}
+
+int
+coro_key_create(coro_key_t *key, void (*destructor)(void *))
+{
+	unsigned int k = __atomic_load_n(&key_count, __ATOMIC_RELAXED);
+	do {
+		if (k >= CORO_KEY_MAX) {
+			errno = EAGAIN;
+			return -1;
+		}
+	} while (!__atomic_compare_exchange_n(&key_count, &k, k + 1, false,
+					      __ATOMIC_RELAXED,
+					      __ATOMIC_RELAXED));
+	key_destructors[k] = destructor;
+	*key = k;
+	return 0;
+}
+
+void **
+coro_local_fast(void)
+{
+	return coro_this_ptr->local;
+}
+
+void *
+coro_getspecific_slow(coro_key_t key)
+{
+	struct coro *c = coro_this_ptr;
+	key -= CORO_KEY_FAST_COUNT;
+	if (key >= c->local_slow_size)
+		return NULL;
+	return c->local_slow[key];
+}
+
+int
+coro_setspecific_slow(coro_key_t key, const void *value)
+{
+	if (key >= CORO_KEY_MAX) {
+		errno = EINVAL;
+		return -1;
+	}
+	struct coro *c = coro_this_ptr;
+	key -= CORO_KEY_FAST_COUNT;
+	if (key >= c->local_slow_size) {
+		/* Make room for all the existing keys at once. */
+		unsigned int size = __atomic_load_n(&key_count,
+						    __ATOMIC_RELAXED);
+		size -= CORO_KEY_FAST_COUNT;
+		if (size <= key)
+			size = key + 1;
+		void **local_slow = realloc(c->local_slow,
+					    size * sizeof(local_slow[0]));
+		if (local_slow == NULL)
+			handle_error();
+		c->local_slow = local_slow;
+		memset(c->local_slow + c->local_slow_size, 0,
+		       (size - c->local_slow_size) * sizeof(c->local_slow[0]));
+		c->local_slow_size = size;
+	}
+	c->local_slow[key] = (void *)value;
+	return 0;
+}
+
+/**
+ * Call the destructors of the coroutine-local values. It is done
+ * in the coroutine, so they can use the coroutine API.
+ */
+static void
+coro_local_destroy(struct coro *c)
+{
+	for (unsigned int i = 0; i < CORO_KEY_FAST_COUNT; ++i) {
+		void *value = c->local[i];
+		c->local[i] = NULL;
+		if (value != NULL && key_destructors[i] != NULL)
+			key_destructors[i](value);
+	}
+	for (unsigned int i = 0; i < c->local_slow_size; ++i) {
+		void *value = c->local_slow[i];
+		c->local_slow[i] = NULL;
+		void (*destructor)(void *) =
+			key_destructors[i + CORO_KEY_FAST_COUNT];
+		if (value != NULL && destructor != NULL)
+			destructor(value);
+	}
+}
+
+/**
+ * Entry point of every coroutine. Runs the coroutine function
+ * and then leaves the context forever, giving the result to the
+ * scheduler.
+ */
+static void
+coro_body(void *arg)
+{
+	struct coro *c = arg;
+	c->ret = c->func(c->func_arg);
+	coro_local_destroy(c);
+	c->state = CORO_STATE_FINISHED;
+	if (coro_is_mt()) {
+		coro_worker_switch(c, CORO_POST_FINISH);
+		abort();
+	}
+	struct coro_sched *s = sched;
+	rlist_add_tail(&s->finished, &c->in_sched);
+	--sched_main.coro_count;
+	coro_sched_update_quantum();
+	coro_account_switch(c, &s->main);
+	/* Can not return - 'ret' address is invalid already! */
+	if (! s->is_waiting) {
+		printf("Critical error - no place to return!\n");
+		exit(-1);
+	}
+	coro_this_ptr = &s->main;
+	coro_ctx_switch(&c->ctx, &s->main.ctx);
+	abort();
+}
+
+void
+coro_attr_create(struct coro_attr *attr)
+{
+	memset(attr, 0, sizeof(*attr));
+	attr->stack_size = CORO_STACK_SIZE_DEFAULT;
+	attr->priority = CORO_PRIO_NORMAL;
+}
+
+/**
+ * Allocate a coroutine which will start in @a body. It is not
+ * known to the scheduler yet.
+ */
+static struct coro *
+coro_create(coro_f func, void *func_arg, const struct coro_attr *attr,
+	    void (*body)(void *))
+{
+	struct coro_attr default_attr;
+	if (attr == NULL) {
+		coro_attr_create(&default_attr);
+		attr = &default_attr;
+	}
+	struct coro *c = (struct coro *) malloc(sizeof(*c));
+	c->ret = 0;
+	c->is_stack_shared = attr->is_stack_shared && CORO_CTX_ASM &&
+			     ! coro_is_mt();
+	c->stack_copy = NULL;
+	c->stack_copy_size = 0;
+	c->stack_copy_capacity = 0;
+	if (c->is_stack_shared) {
+		c->stack = NULL;
+		c->stack_size = CORO_SHARED_STACK_SIZE;
+		c->is_stack_measured = false;
+	} else {
+		size_t stack_size = attr->stack_size;
+		if (stack_size < CORO_STACK_CLASS_MIN_SIZE)
+			stack_size = CORO_STACK_CLASS_MIN_SIZE;
+		if (stack_size < (size_t)SIGSTKSZ)
+			stack_size = SIGSTKSZ;
+		c->stack = coro_stack_pool_get(&sched->stack_pool, stack_size,
+					       &c->stack_size);
+		c->is_stack_measured = attr->is_stack_measured ||
+				       is_stack_check_forced;
+		if (c->is_stack_measured)
+			coro_stack_fill(c->stack, c->stack_size);
+	}
+	c->func = func;
+	c->func_arg = func_arg;
+	c->priority = attr->priority;
+	c->state = CORO_STATE_READY;
+	c->is_wakeup_pending = false;
+	rlist_create(&c->in_wait);
+	c->timer_pos = -1;
+	c->switch_count = 0;
+	c->gen = NULL;
+	c->ready_queue = NULL;
+	c->remote_next = NULL;
+	c->is_remote_queued = false;
+	c->name[0] = 0;
+	coro_sched_lock();
+	rlist_add_tail(&all_coros, &c->in_all);
+	coro_sched_unlock();
+	if (c->is_stack_shared)
+		coro_shared_stack_create(c, body);
+	else
+		coro_ctx_create(&c->ctx, c->stack, c->stack_size, body, c);
+	c->run_cycles = 0;
+	c->wait_cycles = 0;
+	c->ready_cycles = 0;
+	c->max_run_cycles = 0;
+	c->suspend_count = 0;
+	memset(c->local, 0, sizeof(c->local));
+	c->local_slow = NULL;
+	c->local_slow_size = 0;
+	c->run_stop = coro_cycles();
+	c->run_start = c->run_stop;
+	c->ready_start = c->run_stop;
+	return c;
+}
+
+struct coro *
+coro_new_ex(coro_f func, void *func_arg, const struct coro_attr *attr)
+{
+	struct coro *c = coro_create(func, func_arg, attr, coro_body);
+	/* Now scheduler can work with that coroutine. */
+	coro_sched_lock();
+	++sched_main.coro_count;
+	coro_sched_update_quantum();
+	if (coro_is_mt())
+		coro_mt_make_ready(c);
+	else
+		coro_ready_queue_push(&sched->ready, c, false);
+	coro_sched_unlock();
+	return c;
+}
+
+struct coro *
+coro_new(coro_f func, void *func_arg)
+{
+	return coro_new_ex(func, func_arg, NULL);
+}
+
+/**
+ * Generator - a producer coroutine, which is not scheduled. It is
+ * run by the consumer, directly switching to it and back, like a
+ * function call.
+ */
+struct coro_gen {
+	struct coro *producer;
+	/** Who called coro_gen_next(), to switch back to. */
+	struct coro *consumer;
+	bool is_finished;
+	/** Values produced during one run of the producer. */
+	size_t capacity;
+	size_t elem_size;
+	/** Index of the oldest value. */
+	size_t head;
+	size_t count;
+	char data[];
+};
+
+static void
+coro_gen_body(void *arg)
+{
+	struct coro *c = arg;
+	c->ret = c->func(c->func_arg);
+	coro_local_destroy(c);
+	c->state = CORO_STATE_FINISHED;
+	c->gen->is_finished = true;
+	coro_switch_to(c->gen->consumer);
+	abort();
+}
+
+struct coro_gen *
+coro_gen_new(coro_f func, void *arg, size_t elem_size, size_t batch_size)
+{
+	if (batch_size == 0)
+		batch_size = 1;
+	struct coro_gen *gen = malloc(sizeof(*gen) + batch_size * elem_size);
+	if (gen == NULL)
+		handle_error();
+	gen->producer = coro_create(func, arg, NULL, coro_gen_body);
+	gen->producer->gen = gen;
+	gen->consumer = NULL;
+	gen->is_finished = false;
+	gen->capacity = batch_size;
+	gen->elem_size = elem_size;
+	gen->head = 0;
+	gen->count = 0;
+	return gen;
+}
+
+void
+coro_gen_delete(struct coro_gen *gen)
+{
+	coro_delete(gen->producer);
+	free(gen);
+}
+
+void
+coro_gen_yield(const void *value)
+{
+	struct coro_gen *gen = coro_this_ptr->gen;
+	size_t tail = (gen->head + gen->count) % gen->capacity;
+	memcpy(gen->data + tail * gen->elem_size, value, gen->elem_size);
+	if (++gen->count == gen->capacity)
+		coro_switch_to(gen->consumer);
+}
+
+bool
+coro_gen_next(struct coro_gen *gen, void *value)
+{
+	if (gen->count == 0) {
+		if (gen->is_finished)
+			return false;
+		gen->consumer = coro_this_ptr;
+		++gen->producer->switch_count;
+		coro_switch_to(gen->producer);
+		if (gen->count == 0)
+			return false;
+	}
+	memcpy(value, gen->data + gen->head * gen->elem_size,
+	       gen->elem_size);
+	gen->head = (gen->head + 1) % gen->capacity;
+	--gen->count;
+	return true;
+}
+
+int
+coro_gen_status(const struct coro_gen *gen)
+{
+	return gen->producer->ret;
+}
+
+/**
+ * Runner of the stackless coroutines. It is an ordinary coroutine,
+ * not counted as a user one, which calls the functions of the
+ * ready stackless ones. So it is scheduled in turns with the
+ * others, and a stackless switch is just a function call.
+ */
+struct coro_pt_runner {
+	/** Created with the first stackless coroutine. */
+	struct coro *coro;
+	/**
+	 * Ready stackless coroutines, not including the ones being
+	 * run. Protected by the scheduler lock.
+	 */
+	struct coro_pt *head;
+	struct coro_pt *tail;
+	/** True, if the runner is suspended on the empty queue. */
+	bool is_idle;
+};
+
+static struct coro_pt_runner pt_runner;
+
+/** Append a list of ready ones, from @a head to @a tail. */
+static void
+coro_pt_push(struct coro_pt *head, struct coro_pt *tail)
+{
+	tail->next = NULL;
+	if (pt_runner.tail == NULL)
+		pt_runner.head = head;
+	else
+		pt_runner.tail->next = head;
+	pt_runner.tail = tail;
+	if (pt_runner.is_idle) {
+		pt_runner.is_idle = false;
+		coro_wakeup(pt_runner.coro);
+	}
+}
+
+static int
+coro_pt_runner_f(void *arg)
+{
+	(void)arg;
+	while (true) {
+		coro_sched_lock();
+		struct coro_pt *pt = pt_runner.head;
+		pt_runner.head = NULL;
+		pt_runner.tail = NULL;
+		if (pt == NULL) {
+			pt_runner.is_idle = true;
+			coro_suspend();
+			coro_sched_unlock();
+			continue;
+		}
+		coro_sched_unlock();
+		/* Run each one once, then let the others run. */
+		struct coro_pt *ready = NULL, *ready_tail = NULL;
+		while (pt != NULL) {
+			struct coro_pt *next = pt->next;
+			int state = pt->func(pt);
+			if (state == CORO_PT_SUSPENDED) {
+				coro_sched_lock();
+				if (pt->is_wakeup_pending) {
+					pt->is_wakeup_pending = false;
+					state = CORO_PT_READY;
+				} else {
+					pt->state = CORO_PT_SUSPENDED;
+				}
+				coro_sched_unlock();
+			} else if (state == CORO_PT_FINISHED) {
+				coro_sched_lock();
+				pt->state = CORO_PT_FINISHED;
+				coro_sched_unlock();
+			}
+			if (state == CORO_PT_READY) {
+				if (ready == NULL)
+					ready = pt;
+				else
+					ready_tail->next = pt;
+				ready_tail = pt;
+			}
+			pt = next;
+		}
+		if (ready != NULL) {
+			coro_sched_lock();
+			coro_pt_push(ready, ready_tail);
+			coro_sched_unlock();
+		}
+		coro_yield();
+	}
+	return 0;
+}
+
+/** Create the runner. Is called under the scheduler lock. */
+static void
+coro_pt_runner_create(void)
+{
+	struct coro_attr attr;
+	coro_attr_create(&attr);
+	attr.stack_size = CORO_STACK_CLASS_MIN_SIZE;
+	struct coro *c = coro_create(coro_pt_runner_f, NULL, &attr,
+				     coro_body);
+	coro_set_name(c, "stackless runner");
+	pt_runner.coro = c;
+	pt_runner.is_idle = false;
+	if (coro_is_mt())
+		coro_mt_make_ready(c);
+	else
+		coro_ready_queue_push(&sched->ready, c, false);
+}
+
+/**
+ * Delete the runner. It never finishes, but it is suspended or
+ * ready when the scheduler is destroyed.
+ */
+static void
+coro_pt_runner_destroy(void)
+{
+	if (pt_runner.coro == NULL)
+		return;
+	coro_delete(pt_runner.coro);
+	memset(&pt_runner, 0, sizeof(pt_runner));
+}
+
+void
+coro_pt_start(struct coro_pt *pt, coro_pt_f func)
+{
+	pt->resume_line = 0;
+	pt->state = CORO_PT_READY;
+	pt->is_wakeup_pending = false;
+	pt->func = func;
+	coro_sched_lock();
+	if (pt_runner.coro == NULL)
+		coro_pt_runner_create();
+	coro_pt_push(pt, pt);
+	coro_sched_unlock();
+}
+
+void
+coro_pt_wakeup(struct coro_pt *pt)
+{
+	coro_sched_lock();
+	switch (pt->state) {
+	case CORO_PT_SUSPENDED:
+		pt->state = CORO_PT_READY;
+		coro_pt_push(pt, pt);
+		break;
+	case CORO_PT_READY:
+		pt->is_wakeup_pending = true;
+		break;
+	case CORO_PT_FINISHED:
+		break;
+	}
+	coro_sched_unlock();
+}
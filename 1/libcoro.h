@@ -1,17 +1,63 @@
 #pragma once
 
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/socket.h>
 
 struct coro;
 typedef int (*coro_f)(void *);
 
-/** Make current context scheduler. */
+/** Intrusive doubly-linked circular list. */
+struct rlist {
+	struct rlist *prev;
+	struct rlist *next;
+};
+
+/**
+ * Make current context scheduler. If LIBCORO_THREADS environment
+ * variable is set, it is the same as coro_sched_init_mt() with
+ * that number of threads. If LIBCORO_STACK_CHECK is set, stacks of
+ * all the coroutines are measured, and coro_delete() prints how
+ * much of the stack each one has used. LIBCORO_PREEMPT_US is the
+ * same as coro_sched_set_preemption() with that many microseconds.
+ */
 void
 coro_sched_init(void);
 
+/**
+ * Make current context scheduler, which runs the coroutines in
+ * @a thread_count worker threads. Each worker has its own ready
+ * queue, and the idle workers steal the coroutines from the
+ * others. A coroutine can resume in a different thread than it
+ * has been suspended in. The current thread does not run the
+ * coroutines, it only waits for them in coro_sched_wait().
+ * 0 threads mean the single-threaded mode, when the coroutines
+ * are run by coro_sched_wait() itself.
+ *
+ * Warning: the thread-local state is not the same after a switch.
+ * The compiler does not know that, and can reuse pthread_self(),
+ * errno, or the address of a __thread variable read before the
+ * switch, because they are the same within a function for a
+ * usual thread. Read them via a function the compiler can't see
+ * through (a volatile function pointer), and keep the per-coroutine
+ * state in coro_getspecific().
+ */
+void
+coro_sched_init_mt(int thread_count);
+
+/**
+ * Free the scheduler resources, such as the cached stacks. All
+ * the coroutines should be deleted before that.
+ */
+void
+coro_sched_destroy(void);
+
 /**
  * Block until any coroutine has finished. It is returned. NULl,
- * if no coroutines.
+ * if no coroutines, or all of them are suspended and there is
+ * nothing to wake them up.
  */
 struct coro *
 coro_sched_wait(void);
@@ -20,6 +66,48 @@ coro_sched_wait(void);
 struct coro *
 coro_this(void);
 
+enum {
+	/** Max length of a coroutine name, with the terminating 0. */
+	CORO_NAME_MAX = 32,
+};
+
+/** Name the coroutine for the diagnostics. Longer names are cut. */
+void
+coro_set_name(struct coro *c, const char *name);
+
+/** Name of the coroutine, empty if not set. */
+const char *
+coro_name(const struct coro *c);
+
+/**
+ * Called for a too long run slice of @a c, @a run_ns long. It is
+ * called by the coroutine itself right before it switches out,
+ * so backtrace() there shows where the coroutine has given up
+ * the CPU. The hook must not switch.
+ */
+typedef void
+(*coro_long_slice_f)(struct coro *c, uint64_t run_ns);
+
+/**
+ * Report each run slice - the time a coroutine runs between two
+ * switches - longer than @a threshold_ns. With NULL @a hook the
+ * coroutine name, the slice length and a backtrace are printed
+ * to stderr. The backtrace is omitted with the sigaltstack
+ * contexts, which can't be unwound. 0 disables the reports, it is
+ * the default. A check of each slice costs a comparison.
+ */
+void
+coro_sched_set_long_slice(uint64_t threshold_ns, coro_long_slice_f hook);
+
+/**
+ * Print all not deleted coroutines to @a fd: their names,
+ * states, switch counts, run time, the longest slice and the
+ * stack usage. In the multi-threaded mode the running ones
+ * change meanwhile, so the numbers are approximate.
+ */
+void
+coro_sched_dump(int fd);
+
 /**
  * Create a new coroutine. It is not started, just added to the
  * scheduler.
@@ -27,6 +115,69 @@ coro_this(void);
 struct coro *
 coro_new(coro_f func, void *func_arg);
 
+/**
+ * Priority classes. The scheduler runs the highest class which
+ * has ready coroutines. A lower class still gets a turn after it
+ * has been passed over several times in a row, so it does not
+ * starve.
+ */
+enum coro_priority {
+	/** Background work, such as bulk processing. */
+	CORO_PRIO_LOW,
+	/** The default one. */
+	CORO_PRIO_NORMAL,
+	/** Latency-sensitive work. */
+	CORO_PRIO_HIGH,
+	CORO_PRIO_COUNT,
+};
+
+/** Coroutine creation attributes. */
+struct coro_attr {
+	/**
+	 * Stack size in bytes. Only the touched pages of the
+	 * stack consume memory. It is rounded up to a power of 2,
+	 * not less than 16KB. Default is 1MB.
+	 */
+	size_t stack_size;
+	/**
+	 * Fill the stack with a pattern at creation, so that
+	 * coro_stack_used() can find how deep it was used. It
+	 * makes all the stack pages resident, so it is meant for
+	 * choosing the stack size, not for production.
+	 */
+	bool is_stack_measured;
+	/**
+	 * Run on a stack, shared by all such coroutines of the
+	 * scheduler, instead of an own one. The used part of the
+	 * stack is copied out to the heap when another coroutine
+	 * needs it, and copied back before the coroutine continues.
+	 * So a million of idle coroutines cost a few KB each, but
+	 * each switch between them copies their stacks. Their
+	 * locals must not be shared with the other coroutines by
+	 * pointers, nor given to coro_offload() - that is a
+	 * critical error. The file I/O buffers on such a stack are
+	 * copied through the heap. The stack size is 1MB and
+	 * stack_size is ignored. Supported in the single-threaded
+	 * mode on x86-64 and aarch64, otherwise an own stack is
+	 * used.
+	 */
+	bool is_stack_shared;
+	/** Priority class, CORO_PRIO_NORMAL by default. */
+	enum coro_priority priority;
+};
+
+/** Fill the attributes with the default values. */
+void
+coro_attr_create(struct coro_attr *attr);
+
+/**
+ * Create a new coroutine with the given attributes. NULL
+ * attributes mean the default ones. The stack has a guard page,
+ * so an overflow crashes the process right away.
+ */
+struct coro *
+coro_new_ex(coro_f func, void *func_arg, const struct coro_attr *attr);
+
 /** Return status of the coroutine. */
 int
 coro_status(const struct coro *c);
@@ -34,6 +185,57 @@ coro_status(const struct coro *c);
 long long
 coro_switch_count(const struct coro *c);
 
+/**
+ * Time in nanoseconds the coroutine has spent running. It is
+ * measured by the scheduler on each switch.
+ */
+uint64_t
+coro_run_time(const struct coro *c);
+
+/**
+ * Time in nanoseconds the coroutine has spent not running since
+ * its creation: waiting for its turn or suspended.
+ */
+uint64_t
+coro_wait_time(const struct coro *c);
+
+/**
+ * Part of the wait time when the coroutine was ready, but waited
+ * for the others to give it the CPU. The rest is suspension.
+ */
+uint64_t
+coro_ready_time(const struct coro *c);
+
+/**
+ * The longest time in nanoseconds the coroutine has run without
+ * giving the CPU to the others.
+ */
+uint64_t
+coro_max_run_time(const struct coro *c);
+
+/**
+ * How many times the coroutine was suspended. It is a part of
+ * the switch count, the rest is yields.
+ */
+long long
+coro_suspend_count(const struct coro *c);
+
+/**
+ * The peak stack usage in bytes, if the stack is measured. For a
+ * coroutine on the shared stack - the biggest saved part of it.
+ * Otherwise 0.
+ */
+size_t
+coro_stack_used(const struct coro *c);
+
+/**
+ * True, if the coroutine runs on the shared stack. It can be
+ * false even with is_stack_shared attribute, where the shared
+ * stacks are not supported.
+ */
+bool
+coro_is_stack_shared(const struct coro *c);
+
 /** Check if the coroutine has finished. */
 bool
 coro_is_finished(const struct coro *c);
@@ -42,6 +244,715 @@ coro_is_finished(const struct coro *c);
 void
 coro_delete(struct coro *c);
 
-/** Switch to another not finished coroutine. */
+/**
+ * Change the priority class of a coroutine. In the multi-threaded
+ * mode a coroutine which is ready already keeps its place in the
+ * queue, and the new class is used from the next time.
+ */
+void
+coro_set_priority(struct coro *c, enum coro_priority priority);
+
+/**
+ * Switch to another not finished coroutine. The current one keeps
+ * running if it has a higher priority than all the ready ones.
+ * Does nothing in the scheduler context - the code calling
+ * coro_sched_wait().
+ */
 void
 coro_yield(void);
+
+/**
+ * Give the CPU to @a c right away, if it is ready to run. The
+ * current coroutine becomes ready. It skips the other ready ones
+ * and ignores the priorities, so a producer can hand the work to
+ * its consumer directly. If @a c is not ready, it is the same as
+ * coro_yield().
+ *
+ * In the scheduler context - the code calling coro_sched_wait() -
+ * @a c is run first, and the call returns when a coroutine
+ * finishes or none is ready, like a step of coro_sched_wait(). The
+ * finished one is returned by coro_sched_wait(). In the
+ * multi-threaded mode the call does nothing, the workers run the
+ * coroutines.
+ */
+void
+coro_yield_to(struct coro *c);
+
+/** Which of the ready coroutines of one priority class runs next. */
+enum coro_sched_policy {
+	/** In the order they became ready, the default. */
+	CORO_POLICY_FIFO,
+	/**
+	 * The last woken up or created ones run first, while their
+	 * data is hot in the caches. The yielded ones go to the end,
+	 * or a yield would not give the CPU to anybody.
+	 */
+	CORO_POLICY_LIFO,
+	/** Ordered by a user function. */
+	CORO_POLICY_CUSTOM,
+};
+
+/**
+ * True, if @a a should run before @a b. Equal ones run in the
+ * order they became ready. It is called with the ready queue
+ * locked, so it should only look at the coroutines, for example
+ * at coro_run_time().
+ */
+typedef bool
+(*coro_policy_less_f)(const struct coro *a, const struct coro *b);
+
+/**
+ * Set the scheduling policy. @a less is used only by
+ * CORO_POLICY_CUSTOM. The policy is applied when a coroutine is
+ * put into a queue, so it should be set before the coroutines
+ * are created.
+ */
+void
+coro_sched_set_policy(enum coro_sched_policy policy,
+		      coro_policy_less_f less);
+
+/**
+ * Set the scheduler target latency - each coroutine, calling
+ * coro_yield_if_expired(), gets the CPU again not later than
+ * that. The latency is divided equally between all the
+ * coroutines, giving each a quantum of time. 0, the default,
+ * means zero quantum.
+ */
+void
+coro_sched_set_target_latency(uint64_t ns);
+
+/**
+ * Yield only if the current coroutine has been running for its
+ * whole quantum already. Otherwise it costs one read of the CPU
+ * time stamp counter, so can be called in hot loops.
+ */
+void
+coro_yield_if_expired(void);
+
+/**
+ * Enable preemption of the coroutines, running longer than
+ * @a slice_ns without a switch. Each thread, running coroutines,
+ * gets a timer, which sends it SIGALRM a few times per slice. The
+ * signal handler marks the running coroutine overdue, and at its
+ * next coro_preempt_point() or coro_yield_if_expired() it yields.
+ * So a loop which forgets to yield, but has a preemption point,
+ * does not delay the others more than by 1.5 slices. 0, the
+ * default, disables the preemption. It is applied by
+ * coro_sched_init() and coro_sched_init_mt(). The system calls
+ * interrupted by the signal are restarted, if they can be.
+ */
+void
+coro_sched_set_preemption(uint64_t slice_ns);
+
+/**
+ * Yield, if the current coroutine is marked overdue by the
+ * preemption timer. Otherwise it costs one memory read, so it
+ * can be put into the hottest loops.
+ * @retval true The coroutine was preempted.
+ */
+bool
+coro_preempt_point(void);
+
+/** How many times the coroutines were preempted. */
+long long
+coro_sched_preempt_count(void);
+
+/**
+ * Suspend the current coroutine until coro_wakeup() is called
+ * for it. A suspended coroutine is never scheduled and costs
+ * nothing. Callers should recheck what they wait for after
+ * wakeup - it can come from somewhere else.
+ */
+void
+coro_suspend(void);
+
+/** Monotonic time in nanoseconds, the base for the deadlines. */
+uint64_t
+coro_clock_ns(void);
+
+/**
+ * Same as coro_suspend(), but the coroutine is woken up anyway
+ * when coro_clock_ns() reaches @a deadline. When nothing else is
+ * ready, the scheduler sleeps exactly until the closest one.
+ * @retval true Woken up by coro_wakeup().
+ * @retval false The deadline has expired.
+ */
+bool
+coro_suspend_until(uint64_t deadline);
+
+/** Suspend the current coroutine for @a ns nanoseconds. */
+void
+coro_sleep(uint64_t ns);
+
+/**
+ * Make a suspended coroutine ready to run. It is scheduled after
+ * the already ready ones. If the coroutine is not suspended, the
+ * wakeup is not lost: its next coro_suspend() returns at once.
+ */
+void
+coro_wakeup(struct coro *c);
+
+/**
+ * Wake up a coroutine from any thread, even not running the
+ * coroutines, such as a thread pool worker. The coroutine is
+ * pushed into a lock-free inbox of the scheduler, and the first
+ * wakeup in the inbox kicks the scheduler through an eventfd, in
+ * case it sleeps. The scheduler makes the coroutines from the
+ * inbox ready when it polls. The coroutine should wait for it
+ * with coro_suspend_remote(). Several wakeups, coming before the
+ * scheduler has taken the first one, can merge into one.
+ */
+void
+coro_wakeup_remote(struct coro *c);
+
+/**
+ * Same as coro_suspend(), but the scheduler knows that a wakeup
+ * can come from another thread and sleeps until it does, rather
+ * than deciding all the coroutines are stuck. A remote wakeup
+ * which came earlier is not lost.
+ */
+void
+coro_suspend_remote(void);
+
+/**
+ * The scheduler lock, in the multi-threaded mode. It protects the
+ * suspended coroutines and the wait queues, and can be taken
+ * recursively. Take it to check a condition and start waiting on
+ * it atomically - the wait releases the lock while the coroutine
+ * is suspended. In the single-threaded mode it does nothing.
+ */
+void
+coro_sched_lock(void);
+
+void
+coro_sched_unlock(void);
+
+/**
+ * Queue of suspended coroutines, waiting for something. It is a
+ * building block for synchronization primitives, and can be
+ * embedded into other objects. In the multi-threaded mode the
+ * waiter should check its condition under coro_sched_lock(),
+ * otherwise a wakeup between the check and the wait is lost.
+ */
+struct coro_wait_queue {
+	/** Waiting coroutines, in the order of their arrival. */
+	struct rlist waiters;
+};
+
+void
+coro_wait_queue_create(struct coro_wait_queue *wq);
+
+/** Check if there are no waiters. */
+bool
+coro_wait_queue_is_empty(const struct coro_wait_queue *wq);
+
+/**
+ * Suspend the current coroutine in the queue until it is woken
+ * up. Same as coro_suspend(), the wakeup can come not from the
+ * queue.
+ */
+void
+coro_wait_queue_wait(struct coro_wait_queue *wq);
+
+/**
+ * Wake up the longest waiting coroutine and remove it from the
+ * queue.
+ * @retval The woken up coroutine, or NULL if the queue is empty.
+ */
+struct coro *
+coro_wait_queue_wakeup_one(struct coro_wait_queue *wq);
+
+/** Wake up all the waiters. */
+void
+coro_wait_queue_wakeup_all(struct coro_wait_queue *wq);
+
+/**
+ * Bounded channel - a FIFO queue of fixed size elements between
+ * coroutines. A sender blocks while the channel is full, and a
+ * receiver blocks while it is empty.
+ */
+struct coro_chan;
+
+/**
+ * Create a channel for @a capacity elements, at least 1, of
+ * @a elem_size bytes each.
+ */
+struct coro_chan *
+coro_chan_new(size_t capacity, size_t elem_size);
+
+/** Delete a channel. Nobody should wait on it. */
+void
+coro_chan_delete(struct coro_chan *ch);
+
+/**
+ * Close the channel. The blocked senders and receivers are woken
+ * up. Sends fail after that, receives get the remaining elements
+ * and then fail too.
+ */
+void
+coro_chan_close(struct coro_chan *ch);
+
+/**
+ * Copy an element into the channel, waiting for a free slot.
+ * @retval 0 Success.
+ * @retval -1 The channel is closed, errno is EPIPE.
+ */
+int
+coro_chan_send(struct coro_chan *ch, const void *elem);
+
+/**
+ * Take the oldest element from the channel, waiting for one.
+ * @retval 0 Success.
+ * @retval -1 The channel is closed and empty, errno is EPIPE.
+ */
+int
+coro_chan_recv(struct coro_chan *ch, void *elem);
+
+/**
+ * Send as many of @a count elements as fit, waiting until at
+ * least one does. It costs one wait instead of one per element.
+ * @retval >0 Number of sent elements.
+ * @retval 0 @a count is 0, returned right away.
+ * @retval -1 The channel is closed, errno is EPIPE.
+ */
+ssize_t
+coro_chan_send_batch(struct coro_chan *ch, const void *elems, size_t count);
+
+/**
+ * Receive up to @a count elements, waiting until there is at
+ * least one.
+ * @retval >0 Number of received elements.
+ * @retval 0 @a count is 0, returned right away.
+ * @retval -1 The channel is closed and empty, errno is EPIPE.
+ */
+ssize_t
+coro_chan_recv_batch(struct coro_chan *ch, void *elems, size_t count);
+
+/**
+ * Coroutine mutex. Unlock hands it over to the longest waiting
+ * coroutine directly, so a newcomer can't take it in between and
+ * the waiters are never starved.
+ */
+struct coro_mutex {
+	/** Coroutine holding the mutex, NULL if it is free. */
+	struct coro *owner;
+	struct coro_wait_queue waiters;
+};
+
+void
+coro_mutex_create(struct coro_mutex *m);
+
+void
+coro_mutex_lock(struct coro_mutex *m);
+
+/** Lock the mutex if it is free, without waiting. */
+bool
+coro_mutex_trylock(struct coro_mutex *m);
+
+void
+coro_mutex_unlock(struct coro_mutex *m);
+
+/** Condition variable, used together with a coro_mutex. */
+struct coro_cond {
+	struct coro_wait_queue waiters;
+};
+
+void
+coro_cond_create(struct coro_cond *cond);
+
+/**
+ * Unlock the mutex, wait for a signal and lock the mutex again.
+ * Same as with pthread, the wakeup can be spurious and the
+ * condition should be rechecked.
+ */
+void
+coro_cond_wait(struct coro_cond *cond, struct coro_mutex *m);
+
+/** Wake up the longest waiting coroutine. */
+void
+coro_cond_signal(struct coro_cond *cond);
+
+/** Wake up all the waiters. */
+void
+coro_cond_broadcast(struct coro_cond *cond);
+
+/**
+ * Wait group - a counter of unfinished jobs, for example of the
+ * coroutines working on a part of a task. The waiters are woken
+ * up when it drops to zero.
+ */
+struct coro_wait_group {
+	int count;
+	struct coro_wait_queue waiters;
+};
+
+void
+coro_wait_group_create(struct coro_wait_group *wg);
+
+/** Add @a count jobs, can be negative. */
+void
+coro_wait_group_add(struct coro_wait_group *wg, int count);
+
+/** Finish one job. */
+void
+coro_wait_group_done(struct coro_wait_group *wg);
+
+/**
+ * Wait until there are no unfinished jobs. Can be called from
+ * the scheduler context - the code calling coro_sched_wait() -
+ * then the coroutines are run right in the call until the jobs
+ * are done. The finished coroutines stay for coro_sched_wait().
+ * If the jobs can never be done, it is a critical error.
+ */
+void
+coro_wait_group_wait(struct coro_wait_group *wg);
+
+/**
+ * Pool of coroutines, running jobs from a shared queue. The
+ * coroutines and their stacks are created once and reused for
+ * all the jobs, so a job costs much less than coro_new().
+ */
+struct coro_pool;
+
+/**
+ * Create a pool of @a coro_count coroutines. They are usual
+ * coroutines: after the pool is closed and the queue is drained,
+ * they finish and are returned by coro_sched_wait(). Their status
+ * is the number of jobs each has done.
+ */
+struct coro_pool *
+coro_pool_new(int coro_count);
+
+/**
+ * Delete a closed pool, when all its coroutines have finished.
+ */
+void
+coro_pool_delete(struct coro_pool *pool);
+
+/**
+ * Queue a job - a call of @a func with @a arg in one of the pool
+ * coroutines. The result of @a func is ignored. The queue is not
+ * bounded, so it never blocks.
+ */
+void
+coro_pool_submit(struct coro_pool *pool, coro_f func, void *arg);
+
+/**
+ * Wait until all the submitted jobs are done. Same as
+ * coro_wait_group_wait(), can be called from the scheduler
+ * context.
+ */
+void
+coro_pool_wait(struct coro_pool *pool);
+
+/**
+ * Stop accepting new jobs. The coroutines finish after the queue
+ * is empty.
+ */
+void
+coro_pool_close(struct coro_pool *pool);
+
+/**
+ * Generator - a coroutine producing values for a consumer. It is
+ * not scheduled: the consumer switches to it directly to get the
+ * next values, and it switches back when it has filled a batch.
+ * So a long sequence can be consumed lazily, without storing it
+ * all. The producer can't use the other coroutine API, which
+ * could switch to the scheduler, such as yields and waits.
+ */
+struct coro_gen;
+
+/**
+ * Create a generator of values of @a elem_size bytes, running
+ * @a func with @a arg as a producer. It produces up to
+ * @a batch_size values per switch. The bigger batch, the less
+ * switches, but more values are produced ahead of the consumer.
+ */
+struct coro_gen *
+coro_gen_new(coro_f func, void *arg, size_t elem_size, size_t batch_size);
+
+/**
+ * Delete a generator. If the producer has not finished, it is
+ * dropped as is, its stack is not unwound.
+ */
+void
+coro_gen_delete(struct coro_gen *gen);
+
+/**
+ * Give a value to the consumer. Is called by the producer. When
+ * the batch is full, the consumer is resumed.
+ */
+void
+coro_gen_yield(const void *value);
+
+/**
+ * Get the next value from the generator. If there is none in the
+ * batch, the producer is run to fill a new one.
+ * @retval true The value is copied into @a value.
+ * @retval false The producer has finished.
+ */
+bool
+coro_gen_next(struct coro_gen *gen, void *value);
+
+/** The result of the finished producer function. */
+int
+coro_gen_status(const struct coro_gen *gen);
+
+/**
+ * Stackless coroutine, a protothread. It is a function, which is
+ * called again and again, and continues from the point where it
+ * has returned the last time, using a switch on the saved line
+ * number. So it has no stack and costs only this struct, which
+ * is usually embedded into the state of the user. The local
+ * variables do not survive a yield, the state should be kept in
+ * the user struct.
+ *
+ * The ready stackless coroutines are run by the scheduler, in
+ * turns with the ordinary ones, by a coroutine which calls their
+ * functions one by one. They are run while coro_sched_wait()
+ * works. They can use the API which does not switch, such as
+ * coro_wakeup() or coro_wait_group_done(), but can't block. In
+ * the multi-threaded mode they run one at a time.
+ *
+ * Example:
+ *
+ *	struct counter {
+ *		struct coro_pt pt;
+ *		int i;
+ *	};
+ *
+ *	static int
+ *	counter_f(struct coro_pt *pt)
+ *	{
+ *		struct counter *c = (struct counter *)pt;
+ *		CORO_PT_BEGIN(pt);
+ *		for (c->i = 0; c->i < 10; ++c->i)
+ *			CORO_PT_YIELD(pt);
+ *		CORO_PT_END(pt);
+ *	}
+ */
+struct coro_pt;
+
+/**
+ * Function of a stackless coroutine. Returns one of coro_pt_state
+ * through the macros below.
+ */
+typedef int (*coro_pt_f)(struct coro_pt *pt);
+
+enum coro_pt_state {
+	/** In the ready queue, or running. */
+	CORO_PT_READY,
+	/** Waits for coro_pt_wakeup(). */
+	CORO_PT_SUSPENDED,
+	CORO_PT_FINISHED,
+};
+
+/** The fields are private, use the macros and functions. */
+struct coro_pt {
+	/** Where to continue, a line number. 0 is the start. */
+	int resume_line;
+	enum coro_pt_state state;
+	bool is_wakeup_pending;
+	coro_pt_f func;
+	/** Next in the ready queue. */
+	struct coro_pt *next;
+};
+
+#define CORO_PT_BEGIN(pt) switch ((pt)->resume_line) { case 0:
+
+/** Let the other coroutines run, continue from here later. */
+#define CORO_PT_YIELD(pt) do {						\
+	(pt)->resume_line = __LINE__;					\
+	return CORO_PT_READY;						\
+	case __LINE__:;							\
+} while (0)
+
+/** Yield until @a cond is true. */
+#define CORO_PT_WAIT_UNTIL(pt, cond) do {				\
+	(pt)->resume_line = __LINE__;					\
+	case __LINE__:							\
+	if (! (cond))							\
+		return CORO_PT_READY;					\
+} while (0)
+
+/**
+ * Stop being scheduled until coro_pt_wakeup(). As for the
+ * ordinary coroutines, a wakeup which came earlier is not lost.
+ */
+#define CORO_PT_SUSPEND(pt) do {					\
+	(pt)->resume_line = __LINE__;					\
+	return CORO_PT_SUSPENDED;					\
+	case __LINE__:;							\
+} while (0)
+
+/** Finish the coroutine right away. */
+#define CORO_PT_EXIT(pt) do {						\
+	(pt)->resume_line = -1;						\
+	return CORO_PT_FINISHED;					\
+} while (0)
+
+#define CORO_PT_END(pt) } CORO_PT_EXIT(pt)
+
+/**
+ * Start a stackless coroutine. It is put into the ready queue,
+ * nothing is allocated. @a pt should stay alive until the
+ * coroutine finishes.
+ */
+void
+coro_pt_start(struct coro_pt *pt, coro_pt_f func);
+
+/** Make a suspended stackless coroutine ready to run. */
+void
+coro_pt_wakeup(struct coro_pt *pt);
+
+static inline bool
+coro_pt_is_finished(const struct coro_pt *pt)
+{
+	return pt->state == CORO_PT_FINISHED;
+}
+
+/**
+ * Coroutine-local storage, the same as pthread keys, but each
+ * coroutine has its own values. The scheduler context also has
+ * its own ones. A new coroutine starts with all values NULL.
+ */
+typedef unsigned int coro_key_t;
+
+enum {
+	/** Keys stored right in the coroutine, the fastest ones. */
+	CORO_KEY_FAST_COUNT = 8,
+	/** Max number of keys in the process. */
+	CORO_KEY_MAX = 256,
+};
+
+/**
+ * Create a new key. The first CORO_KEY_FAST_COUNT keys are the
+ * fastest. The keys can't be deleted. When a coroutine function
+ * returns, @a destructor is called for each not NULL value of
+ * the key, in the coroutine itself. Returns -1 with errno EAGAIN
+ * when there are CORO_KEY_MAX keys already.
+ */
+int
+coro_key_create(coro_key_t *key, void (*destructor)(void *));
+
+/**
+ * Values of the fast keys of the current coroutine. The pointer
+ * is valid only until the next switch.
+ */
+void **
+coro_local_fast(void) __attribute__((pure));
+
+void *
+coro_getspecific_slow(coro_key_t key);
+
+int
+coro_setspecific_slow(coro_key_t key, const void *value);
+
+/** Get the value of @a key in the current coroutine. */
+static inline void *
+coro_getspecific(coro_key_t key)
+{
+	if (key < CORO_KEY_FAST_COUNT)
+		return coro_local_fast()[key];
+	return coro_getspecific_slow(key);
+}
+
+/**
+ * Set the value of @a key in the current coroutine. Returns -1
+ * with errno EINVAL if the key is not less than CORO_KEY_MAX.
+ */
+static inline int
+coro_setspecific(coro_key_t key, const void *value)
+{
+	if (key < CORO_KEY_FAST_COUNT) {
+		coro_local_fast()[key] = (void *)value;
+		return 0;
+	}
+	return coro_setspecific_slow(key, value);
+}
+
+/**
+ * Coroutine I/O. The functions are the same as their libc
+ * counterparts, but they switch the fd to the non-blocking mode
+ * and, when it is not ready, suspend the current coroutine
+ * instead of blocking the thread. The coroutine is woken up when
+ * epoll reports the fd ready. When all the coroutines wait,
+ * coro_sched_wait() sleeps in epoll_wait().
+ *
+ * They can be called only from a coroutine. An fd used with them
+ * has to be closed with coro_close(), because its state is
+ * remembered by the scheduler.
+ */
+
+ssize_t
+coro_read(int fd, void *buf, size_t size);
+
+ssize_t
+coro_write(int fd, const void *buf, size_t size);
+
+/**
+ * Read or write at @a offset, not changing the file position.
+ * File operations can't be waited for with epoll. They are
+ * submitted to io_uring, and the coroutine is suspended until
+ * the scheduler gets the completion. coro_read() and coro_write()
+ * on a file do the same at the current position. Without
+ * io_uring in the kernel, or with LIBCORO_IO_URING=0 in the
+ * environment at coro_sched_init(), the calls are run by
+ * coro_offload().
+ */
+ssize_t
+coro_pread(int fd, void *buf, size_t size, off_t offset);
+
+ssize_t
+coro_pwrite(int fd, const void *buf, size_t size, off_t offset);
+
+/**
+ * Run a call which can't be made non-blocking, such as open(),
+ * fsync() or fscanf(), in a helper thread. The current coroutine
+ * is suspended meanwhile, and the others keep running. It is
+ * resumed by the scheduler when the call is done. The result of
+ * @a func is returned, and errno is the one it has left. The
+ * function should not use the coroutine API.
+ */
+int
+coro_offload(coro_f func, void *arg);
+
+/** The accepted socket is non-blocking already. */
+int
+coro_accept(int fd, struct sockaddr *addr, socklen_t *addr_len);
+
+int
+coro_connect(int fd, const struct sockaddr *addr, socklen_t addr_len);
+
+/**
+ * Close the fd and forget its state. The coroutines waiting on it
+ * are woken up, and their operation fails with EBADF.
+ */
+int
+coro_close(int fd);
+
+/** Statistics of the stack pool of the scheduler. */
+struct coro_stack_pool_stat {
+	/** How many times a stack was taken from the pool. */
+	long long hits;
+	/** How many times a stack had to be allocated. */
+	long long misses;
+	/** Total size of the stacks kept in the pool now. */
+	size_t size;
+	/** Maximal size of the stacks kept in the pool. */
+	size_t max_size;
+};
+
+/**
+ * Stacks of the deleted coroutines are kept by the scheduler
+ * and reused by the new ones. Set how much memory the pool can
+ * keep. The excess stacks are freed right away. 0 disables the
+ * pooling. Each thread has its own pool, these functions work
+ * with the pool of the current one.
+ */
+void
+coro_stack_pool_set_max_size(size_t size);
+
+/** Get the stack pool statistics. */
+void
+coro_stack_pool_stat(struct coro_stack_pool_stat *stat);
@@ -0,0 +1,468 @@
+#include "libcoro.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+enum {
+	/** Operations timed together, to hide the clock cost. */
+	BENCH_BATCH = 100,
+	/** Max samples per benchmark. */
+	BENCH_SAMPLE_COUNT = 2000,
+};
+
+static long long
+clock_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/** Durations of operation batches, in ns per operation. */
+struct bench_samples {
+	double values[BENCH_SAMPLE_COUNT];
+	int count;
+	/** Operations per sample. */
+	long long ops;
+	/** When the current sample started. */
+	long long start;
+};
+
+static void
+bench_samples_create(struct bench_samples *s, long long ops)
+{
+	s->count = 0;
+	s->ops = ops;
+	s->start = clock_ns();
+}
+
+/** Finish the current sample and start a new one. */
+static void
+bench_samples_add(struct bench_samples *s)
+{
+	long long now = clock_ns();
+	if (s->count < BENCH_SAMPLE_COUNT)
+		s->values[s->count++] = (double)(now - s->start) / s->ops;
+	s->start = now;
+}
+
+static int
+bench_double_cmp(const void *a, const void *b)
+{
+	double l = *(const double *)a, r = *(const double *)b;
+	return l < r ? -1 : l > r;
+}
+
+static void
+bench_report(const char *name, struct bench_samples *s)
+{
+	qsort(s->values, s->count, sizeof(s->values[0]), bench_double_cmp);
+	double p50 = s->values[s->count / 2];
+	double p90 = s->values[s->count * 9 / 10];
+	double p99 = s->values[s->count * 99 / 100];
+	double max = s->values[s->count - 1];
+	printf("%-28s p50 %7.1f  p90 %7.1f  p99 %7.1f  max %8.1f ns/op\n",
+	       name, p50, p90, p99, max);
+}
+
+static void
+bench_attr(struct coro_attr *attr)
+{
+	coro_attr_create(attr);
+	attr->stack_size = 16 * 1024;
+}
+
+static int
+bench_nop_f(void *arg)
+{
+	(void)arg;
+	return 0;
+}
+
+/**
+ * Cost of coro_new(). The stacks come from the pool, as they
+ * would in a long-running program.
+ */
+static void
+bench_create(void)
+{
+	struct bench_samples s;
+	struct coro_attr attr;
+	bench_attr(&attr);
+	coro_sched_init();
+	bench_samples_create(&s, BENCH_BATCH);
+	for (int i = 0; i < BENCH_SAMPLE_COUNT; ++i) {
+		s.start = clock_ns();
+		for (int j = 0; j < BENCH_BATCH; ++j)
+			coro_new_ex(bench_nop_f, NULL, &attr);
+		bench_samples_add(&s);
+		struct coro *c;
+		while ((c = coro_sched_wait()) != NULL)
+			coro_delete(c);
+	}
+	coro_sched_destroy();
+	bench_report("Creation", &s);
+}
+
+struct bench_yield_ctx {
+	/** Yields of each coroutine. */
+	long long yield_count;
+	/** The first coroutine takes a sample once in that yields. */
+	long long sample_period;
+	struct bench_samples *samples;
+};
+
+static int
+bench_yield_f(void *arg)
+{
+	struct bench_yield_ctx *ctx = arg;
+	for (long long i = 0; i < ctx->yield_count; ++i)
+		coro_yield();
+	return 0;
+}
+
+static int
+bench_yield_sampler_f(void *arg)
+{
+	struct bench_yield_ctx *ctx = arg;
+	ctx->samples->start = clock_ns();
+	for (long long i = 1; i <= ctx->yield_count; ++i) {
+		coro_yield();
+		if (i % ctx->sample_period == 0)
+			bench_samples_add(ctx->samples);
+	}
+	return 0;
+}
+
+/**
+ * Switch cost with @a coro_count coroutines, yielding to each
+ * other in a round. 2 coroutines is a ping-pong. The scheduler
+ * work does not depend on the coroutine count. But the more
+ * coroutines, the less of their stacks fit into CPU caches. On
+ * the shared stack each switch copies the stacks too.
+ */
+static void
+bench_round_robin(const char *name, int coro_count, bool is_stack_shared)
+{
+	struct bench_samples s;
+	struct bench_yield_ctx ctx;
+	struct coro_attr attr;
+	bench_attr(&attr);
+	attr.is_stack_shared = is_stack_shared;
+	/* Each sample takes at least BENCH_BATCH switches. */
+	ctx.sample_period = (BENCH_BATCH + coro_count - 1) / coro_count;
+	long long sample_count = 4000000 / (ctx.sample_period * coro_count);
+	if (sample_count > BENCH_SAMPLE_COUNT)
+		sample_count = BENCH_SAMPLE_COUNT;
+	if (sample_count < 20)
+		sample_count = 20;
+	ctx.yield_count = sample_count * ctx.sample_period;
+	ctx.samples = &s;
+	bench_samples_create(&s, ctx.sample_period * coro_count);
+	coro_sched_init();
+	coro_new_ex(bench_yield_sampler_f, &ctx, &attr);
+	for (int i = 1; i < coro_count; ++i)
+		coro_new_ex(bench_yield_f, &ctx, &attr);
+	struct coro *c;
+	uint64_t ready_time = 0;
+	uint64_t max_run_time = 0;
+	size_t stack_used = 0;
+	while ((c = coro_sched_wait()) != NULL) {
+		ready_time += coro_ready_time(c);
+		stack_used += coro_stack_used(c);
+		if (coro_max_run_time(c) > max_run_time)
+			max_run_time = coro_max_run_time(c);
+		coro_delete(c);
+	}
+	coro_sched_destroy();
+	bench_report(name, &s);
+	printf("%-28s avg ready %.3f ms, longest run %.1f us\n", "",
+	       ready_time * 1e-6 / coro_count, max_run_time * 1e-3);
+	if (is_stack_shared) {
+		printf("%-28s avg saved stack %zu bytes\n", "",
+		       stack_used / coro_count);
+	}
+}
+
+struct bench_pt {
+	struct coro_pt pt;
+	long long i;
+	/** Not NULL for the one which takes the samples. */
+	struct bench_yield_ctx *ctx;
+	long long yield_count;
+};
+
+static int
+bench_pt_nop_f(struct coro_pt *pt)
+{
+	CORO_PT_BEGIN(pt);
+	CORO_PT_END(pt);
+}
+
+/** Cost of coro_pt_start(), compare with coro_new(). */
+static void
+bench_pt_create(void)
+{
+	struct bench_samples s;
+	struct bench_pt pts[BENCH_BATCH];
+	coro_sched_init();
+	bench_samples_create(&s, BENCH_BATCH);
+	for (int i = 0; i < BENCH_SAMPLE_COUNT; ++i) {
+		s.start = clock_ns();
+		for (int j = 0; j < BENCH_BATCH; ++j)
+			coro_pt_start(&pts[j].pt, bench_pt_nop_f);
+		bench_samples_add(&s);
+		coro_sched_wait();
+	}
+	coro_sched_destroy();
+	bench_report("Stackless creation", &s);
+}
+
+static int
+bench_pt_yield_f(struct coro_pt *pt)
+{
+	struct bench_pt *p = (struct bench_pt *)pt;
+	CORO_PT_BEGIN(pt);
+	for (p->i = 1; p->i <= p->yield_count; ++p->i) {
+		CORO_PT_YIELD(pt);
+		if (p->ctx != NULL && p->i % p->ctx->sample_period == 0)
+			bench_samples_add(p->ctx->samples);
+	}
+	CORO_PT_END(pt);
+}
+
+/** The same as bench_round_robin(), with stackless coroutines. */
+static void
+bench_pt_round_robin(const char *name, int coro_count)
+{
+	struct bench_samples s;
+	struct bench_yield_ctx ctx;
+	ctx.sample_period = (BENCH_BATCH + coro_count - 1) / coro_count;
+	long long sample_count = 4000000 / (ctx.sample_period * coro_count);
+	if (sample_count > BENCH_SAMPLE_COUNT)
+		sample_count = BENCH_SAMPLE_COUNT;
+	if (sample_count < 20)
+		sample_count = 20;
+	ctx.yield_count = sample_count * ctx.sample_period;
+	ctx.samples = &s;
+	struct bench_pt *pts = calloc(coro_count, sizeof(*pts));
+	coro_sched_init();
+	for (int i = 0; i < coro_count; ++i) {
+		pts[i].ctx = i == 0 ? &ctx : NULL;
+		pts[i].yield_count = ctx.yield_count;
+		coro_pt_start(&pts[i].pt, bench_pt_yield_f);
+	}
+	bench_samples_create(&s, ctx.sample_period * coro_count);
+	coro_sched_wait();
+	coro_sched_destroy();
+	free(pts);
+	bench_report(name, &s);
+}
+
+struct bench_handoff_ctx {
+	long long count;
+	struct coro *peer;
+	struct bench_samples *samples;
+};
+
+static int
+bench_handoff_f(void *arg)
+{
+	struct bench_handoff_ctx *ctx = arg;
+	if (ctx->samples != NULL)
+		ctx->samples->start = clock_ns();
+	for (long long i = 1; i <= ctx->count; ++i) {
+		coro_yield_to(ctx->peer);
+		if (ctx->samples != NULL && i % (BENCH_BATCH / 2) == 0)
+			bench_samples_add(ctx->samples);
+	}
+	return 0;
+}
+
+/**
+ * Ping-pong through coro_yield_to() while 100 more coroutines are
+ * ready. A plain yield would run them all between the two.
+ */
+static void
+bench_handoff(void)
+{
+	struct bench_samples s;
+	struct coro_attr attr;
+	bench_attr(&attr);
+	struct bench_yield_ctx noise;
+	noise.yield_count = 2000;
+	struct bench_handoff_ctx a, b;
+	a.count = b.count = BENCH_SAMPLE_COUNT * BENCH_BATCH / 2;
+	a.samples = &s;
+	b.samples = NULL;
+	bench_samples_create(&s, BENCH_BATCH);
+	coro_sched_init();
+	b.peer = coro_new_ex(bench_handoff_f, &a, &attr);
+	a.peer = coro_new_ex(bench_handoff_f, &b, &attr);
+	for (int i = 0; i < 100; ++i)
+		coro_new_ex(bench_yield_f, &noise, &attr);
+	struct coro *c;
+	while ((c = coro_sched_wait()) != NULL)
+		coro_delete(c);
+	coro_sched_destroy();
+	bench_report("Handoff switch", &s);
+}
+
+struct bench_pool_ctx {
+	struct coro_pool *pool;
+	struct bench_samples *samples;
+};
+
+static int
+bench_pool_f(void *arg)
+{
+	struct bench_pool_ctx *ctx = arg;
+	ctx->samples->start = clock_ns();
+	for (int i = 0; i < BENCH_SAMPLE_COUNT; ++i) {
+		for (int j = 0; j < BENCH_BATCH; ++j)
+			coro_pool_submit(ctx->pool, bench_nop_f, NULL);
+		coro_pool_wait(ctx->pool);
+		bench_samples_add(ctx->samples);
+	}
+	coro_pool_close(ctx->pool);
+	return 0;
+}
+
+/**
+ * A job in a coroutine pool, from submit till done. Compare with
+ * the creation cost, paid for each new coroutine.
+ */
+static void
+bench_pool(void)
+{
+	struct bench_samples s;
+	struct bench_pool_ctx ctx;
+	bench_samples_create(&s, BENCH_BATCH);
+	coro_sched_init();
+	ctx.pool = coro_pool_new(10);
+	ctx.samples = &s;
+	coro_new(bench_pool_f, &ctx);
+	struct coro *c;
+	while ((c = coro_sched_wait()) != NULL)
+		coro_delete(c);
+	coro_pool_delete(ctx.pool);
+	coro_sched_destroy();
+	bench_report("Pool job", &s);
+}
+
+static int
+bench_gen_f(void *arg)
+{
+	(void)arg;
+	for (long long i = 0; ; ++i)
+		coro_gen_yield(&i);
+	return 0;
+}
+
+/** Cost of a generator value, with a switch per batch. */
+static void
+bench_gen(size_t batch_size)
+{
+	struct bench_samples s;
+	coro_sched_init();
+	struct coro_gen *gen = coro_gen_new(bench_gen_f, NULL,
+					    sizeof(long long), batch_size);
+	long long value;
+	bench_samples_create(&s, BENCH_BATCH * 10);
+	for (int i = 0; i < BENCH_SAMPLE_COUNT; ++i) {
+		for (int j = 0; j < BENCH_BATCH * 10; ++j)
+			coro_gen_next(gen, &value);
+		bench_samples_add(&s);
+	}
+	coro_gen_delete(gen);
+	coro_sched_destroy();
+	char name[64];
+	snprintf(name, sizeof(name), "Generator value, batch %zu",
+		 batch_size);
+	bench_report(name, &s);
+}
+
+static __thread void *bench_tls;
+
+static int
+bench_local_f(void *arg)
+{
+	coro_key_t *keys = arg;
+	struct bench_samples tls, fast, slow;
+	uintptr_t sum = 0;
+	coro_setspecific(keys[0], &sum);
+	coro_setspecific(keys[1], &sum);
+	bench_tls = &sum;
+	bench_samples_create(&tls, BENCH_BATCH);
+	for (int i = 0; i < BENCH_SAMPLE_COUNT; ++i) {
+		for (int j = 0; j < BENCH_BATCH; ++j) {
+			sum += (uintptr_t)bench_tls;
+			__asm__ __volatile__("" ::: "memory");
+		}
+		bench_samples_add(&tls);
+	}
+	bench_samples_create(&fast, BENCH_BATCH);
+	for (int i = 0; i < BENCH_SAMPLE_COUNT; ++i) {
+		for (int j = 0; j < BENCH_BATCH; ++j) {
+			sum += (uintptr_t)coro_getspecific(keys[0]);
+			__asm__ __volatile__("" ::: "memory");
+		}
+		bench_samples_add(&fast);
+	}
+	bench_samples_create(&slow, BENCH_BATCH);
+	for (int i = 0; i < BENCH_SAMPLE_COUNT; ++i) {
+		for (int j = 0; j < BENCH_BATCH; ++j) {
+			sum += (uintptr_t)coro_getspecific(keys[1]);
+			__asm__ __volatile__("" ::: "memory");
+		}
+		bench_samples_add(&slow);
+	}
+	bench_report("Thread-local get", &tls);
+	bench_report("Coroutine-local fast get", &fast);
+	bench_report("Coroutine-local slow get", &slow);
+	return sum == 0;
+}
+
+/** Coroutine-local storage access compared with __thread. */
+static void
+bench_local(void)
+{
+	coro_key_t keys[CORO_KEY_FAST_COUNT + 1];
+	for (int i = 0; i <= CORO_KEY_FAST_COUNT; ++i)
+		coro_key_create(&keys[i], NULL);
+	/* The first key is fast, the last one is slow. */
+	keys[1] = keys[CORO_KEY_FAST_COUNT];
+	coro_sched_init();
+	coro_new(bench_local_f, keys);
+	coro_delete(coro_sched_wait());
+	coro_sched_destroy();
+}
+
+int
+main(void)
+{
+	bench_create();
+	bench_pt_create();
+	bench_pool();
+	bench_gen(1);
+	bench_gen(16);
+	bench_local();
+	bench_round_robin("Ping-pong switch", 2, false);
+	bench_handoff();
+	char name[64];
+	for (int count = 10; count <= 100000; count *= 100) {
+		snprintf(name, sizeof(name), "Round-robin %d switch", count);
+		bench_round_robin(name, count, false);
+	}
+	bench_pt_round_robin("Stackless ping-pong switch", 2);
+	for (int count = 10; count <= 100000; count *= 100) {
+		snprintf(name, sizeof(name), "Stackless %d switch", count);
+		bench_pt_round_robin(name, count);
+	}
+	for (int count = 10; count <= 100000; count *= 100) {
+		snprintf(name, sizeof(name), "Shared stack %d switch", count);
+		bench_round_robin(name, count, true);
+	}
+	return 0;
+}
@@ -0,0 +1,2793 @@
+#include "libcoro.h"
+
+#include "unit.h"
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <time.h>
+#include <string.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+static int
+coro_ret_arg_f(void *arg)
+{
+	return (int)(long)arg;
+}
+
+static void
+test_basic(void)
+{
+	unit_test_start();
+
+	coro_sched_init();
+	unit_check(coro_sched_wait() == NULL, "no coroutines");
+
+	struct coro *c = coro_new(coro_ret_arg_f, (void *)42);
+	unit_check(c != NULL, "created");
+	unit_check(! coro_is_finished(c), "not started yet");
+	unit_check(coro_sched_wait() == c, "finished");
+	unit_check(coro_is_finished(c), "is finished");
+	unit_check(coro_status(c) == 42, "status");
+	coro_delete(c);
+	unit_check(coro_sched_wait() == NULL, "no more coroutines");
+	coro_sched_destroy();
+
+	unit_test_finish();
+}
+
+struct yield_ctx {
+	int *log;
+	int *log_size;
+	int id;
+	double value;
+};
+
+static int
+coro_yield_f(void *arg)
+{
+	struct yield_ctx *ctx = arg;
+	for (int i = 0; i < 3; ++i) {
+		ctx->log[(*ctx->log_size)++] = ctx->id;
+		/*
+		 * Keep a float value alive across the switch to
+		 * check the FPU state is not lost.
+		 */
+		double v = ctx->value * (i + 1);
+		coro_yield();
+		ctx->value = v / (i + 1) + 1;
+	}
+	return ctx->id;
+}
+
+static void
+test_yield(void)
+{
+	unit_test_start();
+
+	coro_sched_init();
+	int log[6];
+	int log_size = 0;
+	struct yield_ctx ctx1 = {log, &log_size, 1, 0.5};
+	struct yield_ctx ctx2 = {log, &log_size, 2, 1.5};
+	coro_new(coro_yield_f, &ctx1);
+	coro_new(coro_yield_f, &ctx2);
+	struct coro *c;
+	int sum = 0;
+	long long switches = 0;
+	while ((c = coro_sched_wait()) != NULL) {
+		sum += coro_status(c);
+		switches += coro_switch_count(c);
+		coro_delete(c);
+	}
+	unit_check(sum == 3, "both finished");
+	unit_check(log_size == 6, "all steps are done");
+	bool interleaved = true;
+	for (int i = 1; i < log_size; ++i)
+		interleaved = interleaved && log[i] != log[i - 1];
+	unit_check(interleaved, "coroutines are interleaved");
+	unit_check(switches >= 6, "switch count");
+	unit_check(ctx1.value == 3.5 && ctx2.value == 4.5, "float state");
+	coro_sched_destroy();
+
+	unit_test_finish();
+}
+
+static int
+coro_child_f(void *arg);
+
+static void
+test_yield_sched(void)
+{
+	unit_test_start();
+
+	coro_sched_init();
+	int counter = 0;
+	coro_new(coro_child_f, &counter);
+	coro_yield();
+	unit_check(counter == 0, "yield of the scheduler runs nothing");
+	struct coro *c;
+	while ((c = coro_sched_wait()) != NULL)
+		coro_delete(c);
+	unit_check(counter == 1, "coroutine is run by the scheduler");
+	coro_sched_destroy();
+
+	unit_test_finish();
+}
+
+static int
+coro_child_f(void *arg)
+{
+	int *counter = arg;
+	coro_yield();
+	++*counter;
+	return 0;
+}
+
+static int
+coro_parent_f(void *arg)
+{
+	for (int i = 0; i < 10; ++i) {
+		coro_new(coro_child_f, arg);
+		coro_yield();
+	}
+	return 0;
+}
+
+static void
+test_nested_new(void)
+{
+	unit_test_start();
+
+	coro_sched_init();
+	int counter = 0;
+	coro_new(coro_parent_f, &counter);
+	int count = 0;
+	struct coro *c;
+	while ((c = coro_sched_wait()) != NULL) {
+		coro_delete(c);
+		++count;
+	}
+	unit_check(count == 11, "all coroutines are finished");
+	unit_check(counter == 10, "children did their job");
+	coro_sched_destroy();
+
+	unit_test_finish();
+}
+
+static void
+test_stack_pool(void)
+{
+	unit_test_start();
+
+	coro_sched_init();
+	struct coro_stack_pool_stat stat;
+	for (int i = 0; i < 100; ++i) {
+		coro_new(coro_ret_arg_f, NULL);
+		coro_delete(coro_sched_wait());
+	}
+	coro_stack_pool_stat(&stat);
+	unit_check(stat.misses == 1 && stat.hits == 99,
+		   "stacks are reused");
+	unit_check(stat.size > 0, "the pool keeps a stack");
+
+	for (int i = 0; i < 3; ++i)
+		coro_new(coro_ret_arg_f, NULL);
+	for (int i = 0; i < 3; ++i)
+		coro_delete(coro_sched_wait());
+	coro_stack_pool_stat(&stat);
+	unit_check(stat.misses == 3 && stat.hits == 100,
+		   "the pool was empty for 2 more stacks");
+	size_t one_stack = stat.size / 3;
+
+	coro_stack_pool_set_max_size(one_stack);
+	coro_stack_pool_stat(&stat);
+	unit_check(stat.size == one_stack, "the pool is trimmed");
+	coro_new(coro_ret_arg_f, NULL);
+	coro_new(coro_ret_arg_f, NULL);
+	coro_delete(coro_sched_wait());
+	coro_delete(coro_sched_wait());
+	coro_stack_pool_stat(&stat);
+	unit_check(stat.size == one_stack, "the pool respects the limit");
+
+	coro_stack_pool_set_max_size(0);
+	coro_stack_pool_stat(&stat);
+	unit_check(stat.size == 0, "the pool is empty");
+	coro_new(coro_ret_arg_f, NULL);
+	coro_delete(coro_sched_wait());
+	coro_stack_pool_stat(&stat);
+	unit_check(stat.size == 0, "pooling is disabled");
+	coro_stack_pool_set_max_size(64 * 1024 * 1024);
+	coro_sched_destroy();
+
+	unit_test_finish();
+}
+
+static int
+coro_yield_once_f(void *arg)
+{
+	(void)arg;
+	coro_yield();
+	return 0;
+}
+
+static void
+test_stack_size(void)
+{
+	unit_test_start();
+
+	coro_sched_init();
+	struct coro_attr attr;
+	coro_attr_create(&attr);
+	unit_check(attr.stack_size == 1024 * 1024, "default stack size");
+	attr.stack_size = 16 * 1024;
+	/*
+	 * Many coroutines with the default stack would take lots
+	 * of address space. And each guard page should not be a
+	 * separate mapping, or the kernel limit would be hit.
+	 */
+	int count = 100000;
+	for (int i = 0; i < count; ++i)
+		unit_fail_if(coro_new_ex(coro_yield_once_f, NULL, &attr) ==
+			     NULL);
+	struct coro *c;
+	int finished = 0;
+	while ((c = coro_sched_wait()) != NULL) {
+		coro_delete(c);
+		++finished;
+	}
+	unit_check(finished == count, "many small coroutines");
+	coro_sched_destroy();
+
+	unit_test_finish();
+}
+
+static int
+coro_overflow_f(void *arg)
+{
+	volatile char buf[1024];
+	int depth = (int)(long)arg;
+	buf[0] = (char)depth;
+	if (depth == -1)
+		return 0;
+	return coro_overflow_f((void *)(long)(depth + 1)) + buf[0];
+}
+
+static void
+test_stack_overflow(void)
+{
+	unit_test_start();
+
+	fflush(stdout);
+	pid_t pid = fork();
+	unit_fail_if(pid < 0);
+	if (pid == 0) {
+		coro_sched_init();
+		struct coro_attr attr;
+		coro_attr_create(&attr);
+		attr.stack_size = 16 * 1024;
+		coro_new_ex(coro_overflow_f, NULL, &attr);
+		coro_sched_wait();
+		_exit(0);
+	}
+	int status;
+	unit_fail_if(waitpid(pid, &status, 0) != pid);
+	unit_check(WIFSIGNALED(status) && WTERMSIG(status) == SIGSEGV,
+		   "overflow crashes on the guard page");
+
+	unit_test_finish();
+}
+
+/** Use about @a arg KB of the stack. */
+static int
+coro_deep_f(void *arg)
+{
+	volatile char buf[1024];
+	int depth = (int)(long)arg;
+	buf[0] = (char)depth;
+	if (depth <= 1)
+		return 0;
+	return coro_deep_f((void *)(long)(depth - 1)) + buf[0];
+}
+
+static void
+test_stack_used(void)
+{
+	unit_test_start();
+
+	coro_sched_init();
+	struct coro_attr attr;
+	coro_attr_create(&attr);
+	attr.stack_size = 64 * 1024;
+	attr.is_stack_measured = true;
+	struct coro *deep = coro_new_ex(coro_deep_f, (void *)32L, &attr);
+	struct coro *flat = coro_new_ex(coro_deep_f, (void *)1L, &attr);
+	attr.is_stack_measured = false;
+	struct coro *plain = coro_new_ex(coro_deep_f, (void *)1L, &attr);
+	unit_check(coro_sched_wait() == deep, "deep finished");
+	unit_check(coro_sched_wait() == flat, "flat finished");
+	unit_check(coro_sched_wait() == plain, "plain finished");
+	/*
+	 * The context start and the scheduler calls take a part of
+	 * the stack too, more with optimizations. With sigaltstack
+	 * contexts it is also a signal frame, as big as the CPU
+	 * state. So the deep one is compared to the flat one, ~1KB
+	 * per frame.
+	 */
+	size_t flat_used = coro_stack_used(flat);
+	unit_check(flat_used >= 1024 && flat_used < 16 * 1024,
+		   "flat stack used");
+	size_t used = coro_stack_used(deep) - flat_used;
+	unit_check(used >= 28 * 1024 && used < 40 * 1024, "deep stack used");
+	unit_check(coro_stack_used(plain) == 0, "not measured");
+	coro_delete(deep);
+	coro_delete(flat);
+	coro_delete(plain);
+
+	/* A reused stack is measured anew. */
+	attr.is_stack_measured = true;
+	flat = coro_new_ex(coro_deep_f, (void *)1L, &attr);
+	unit_check(coro_sched_wait() == flat, "flat finished");
+	unit_check(coro_stack_used(flat) == flat_used, "stack is refilled");
+	coro_delete(flat);
+	coro_sched_destroy();
+
+	unit_test_finish();
+}
+
+/**
+ * Fill @a arg KB of the stack with a pattern of the coroutine,
+ * yield and check the pattern survived.
+ */
+static int
+coro_shared_f(void *arg)
+{
+	char buf[1024];
+	int depth = (int)(long)arg;
+	char *p = buf;
+	char pattern = (char)((uintptr_t)coro_this() >> 4) + depth;
+	memset(buf, pattern, sizeof(buf));
+	bool ok;
+	if (depth > 1) {
+		ok = coro_shared_f((void *)(long)(depth - 1)) != 0;
+	} else {
+		for (int i = 0; i < 3; ++i)
+			coro_yield();
+		ok = true;
+	}
+	for (size_t i = 0; i < sizeof(buf); ++i)
+		ok = ok && p[i] == pattern;
+	return ok;
+}
+
+static void
+test_stack_shared(void)
+{
+	unit_test_start();
+
+	int thread_counts[] = {0, 4};
+	for (int t = 0; t < 2; ++t) {
+		coro_sched_init_mt(thread_counts[t]);
+		struct coro_attr attr;
+		coro_attr_create(&attr);
+		attr.is_stack_shared = true;
+		int coro_count = 10000;
+		for (int i = 0; i < coro_count; ++i) {
+			long depth = i % 10 == 0 ? 16 : 1;
+			if (i % 100 == 0)
+				coro_new(coro_shared_f, (void *)depth);
+			else
+				coro_new_ex(coro_shared_f, (void *)depth, &attr);
+		}
+		struct coro *c;
+		int ok = 0;
+		int shared_count = 0;
+		size_t max_used = 0;
+		while ((c = coro_sched_wait()) != NULL) {
+			ok += coro_status(c);
+			if (coro_is_stack_shared(c))
+				++shared_count;
+			if (coro_stack_used(c) > max_used)
+				max_used = coro_stack_used(c);
+			coro_delete(c);
+		}
+		unit_check(ok == coro_count, "stacks are intact");
+		/* Without shared stack support there are no copies. */
+		if (shared_count > 0) {
+			unit_check(max_used >= 16 * 1024 &&
+				   max_used < 24 * 1024,
+				   "only the used part is saved");
+		}
+		coro_sched_destroy();
+	}
+
+	unit_test_finish();
+}
+
+struct wait_ctx {
+	struct coro_wait_queue wq;
+	int value;
+	int done;
+};
+
+static int
+coro_waiter_f(void *arg)
+{
+	struct wait_ctx *ctx = arg;
+	while (ctx->value == 0)
+		coro_wait_queue_wait(&ctx->wq);
+	++ctx->done;
+	return 0;
+}
+
+static int
+coro_busy_f(void *arg)
+{
+	int count = (int)(long)arg;
+	for (int i = 0; i < count; ++i)
+		coro_yield();
+	return 0;
+}
+
+static void
+test_suspend(void)
+{
+	unit_test_start();
+
+	coro_sched_init();
+	struct wait_ctx ctx;
+	coro_wait_queue_create(&ctx.wq);
+	ctx.value = 0;
+	ctx.done = 0;
+	int waiter_count = 1000;
+	struct coro *waiters[waiter_count];
+	for (int i = 0; i < waiter_count; ++i)
+		waiters[i] = coro_new(coro_waiter_f, &ctx);
+	struct coro *busy = coro_new(coro_busy_f, (void *)1000L);
+	unit_check(coro_sched_wait() == busy, "busy one has finished");
+	coro_delete(busy);
+	long long switches = 0;
+	for (int i = 0; i < waiter_count; ++i)
+		switches += coro_switch_count(waiters[i]);
+	unit_check(switches == waiter_count,
+		   "suspended coroutines are not scheduled");
+	unit_check(coro_sched_wait() == NULL,
+		   "nothing to run when all are suspended");
+
+	coro_wakeup(waiters[0]);
+	unit_check(coro_sched_wait() == NULL, "spurious wakeup");
+	unit_check(coro_switch_count(waiters[0]) == 2, "woken up once");
+	unit_check(! coro_wait_queue_is_empty(&ctx.wq), "still waits");
+
+	ctx.value = 1;
+	unit_check(coro_wait_queue_wakeup_one(&ctx.wq) == waiters[1],
+		   "wakeup in the order of waiting");
+	unit_check(coro_sched_wait() == waiters[1], "woken one finished");
+	coro_delete(waiters[1]);
+
+	coro_wait_queue_wakeup_all(&ctx.wq);
+	unit_check(coro_wait_queue_is_empty(&ctx.wq), "no waiters");
+	struct coro *c;
+	while ((c = coro_sched_wait()) != NULL)
+		coro_delete(c);
+	unit_check(ctx.done == waiter_count, "all are done");
+	coro_sched_destroy();
+
+	unit_test_finish();
+}
+
+static int
+coro_suspend_self_f(void *arg)
+{
+	int *step = arg;
+	coro_wakeup(coro_this());
+	coro_suspend();
+	*step = 1;
+	coro_suspend();
+	*step = 2;
+	return 0;
+}
+
+static void
+test_wakeup_pending(void)
+{
+	unit_test_start();
+
+	coro_sched_init();
+	int step = 0;
+	struct coro *c = coro_new(coro_suspend_self_f, &step);
+	unit_check(coro_sched_wait() == NULL, "suspended");
+	unit_check(step == 1, "early wakeup is not lost");
+	coro_wakeup(c);
+	unit_check(coro_sched_wait() == c, "finished");
+	unit_check(step == 2, "woken up by the scheduler");
+	coro_delete(c);
+	coro_sched_destroy();
+
+	unit_test_finish();
+}
+
+struct io_ctx {
+	int fd;
+	int size;
+	int count;
+	long long bytes;
+};
+
+static int
+coro_reader_f(void *arg)
+{
+	struct io_ctx *ctx = arg;
+	char buf[4096];
+	ssize_t rc;
+	while ((rc = coro_read(ctx->fd, buf, sizeof(buf))) > 0)
+		ctx->bytes += rc;
+	return rc;
+}
+
+static int
+coro_writer_f(void *arg)
+{
+	struct io_ctx *ctx = arg;
+	char *buf = malloc(ctx->size);
+	memset(buf, 'a', ctx->size);
+	for (int i = 0; i < ctx->count; ++i) {
+		int done = 0;
+		while (done < ctx->size) {
+			ssize_t rc = coro_write(ctx->fd, buf + done,
+						ctx->size - done);
+			if (rc < 0)
+				break;
+			done += rc;
+			ctx->bytes += rc;
+		}
+		coro_yield();
+	}
+	free(buf);
+	coro_close(ctx->fd);
+	return 0;
+}
+
+static void
+test_io_pipe(void)
+{
+	unit_test_start();
+
+	coro_sched_init();
+	int fds[2];
+	unit_fail_if(pipe(fds) != 0);
+	struct io_ctx rctx = {fds[0], 0, 0, 0};
+	/* Much more than a pipe buffer. */
+	struct io_ctx wctx = {fds[1], 1024 * 1024, 4, 0};
+	struct coro *r = coro_new(coro_reader_f, &rctx);
+	struct coro *w = coro_new(coro_writer_f, &wctx);
+	unit_check(coro_sched_wait() == w, "writer finished");
+	unit_check(coro_sched_wait() == r, "reader finished");
+	unit_check(coro_status(r) == 0, "reader got EOF");
+	unit_check(wctx.bytes == 4 * 1024 * 1024 && rctx.bytes == wctx.bytes,
+		   "all is transferred");
+	coro_delete(r);
+	coro_delete(w);
+	coro_close(fds[0]);
+	coro_sched_destroy();
+
+	unit_test_finish();
+}
+
+static int
+coro_ping_f(void *arg)
+{
+	struct io_ctx *ctx = arg;
+	char buf[64];
+	memset(buf, 0, sizeof(buf));
+	for (int i = 0; i < ctx->count; ++i) {
+		if (coro_write(ctx->fd, buf, sizeof(buf)) != sizeof(buf))
+			return -1;
+		int done = 0;
+		while (done < (int)sizeof(buf)) {
+			ssize_t rc = coro_read(ctx->fd, buf + done,
+					       sizeof(buf) - done);
+			if (rc <= 0)
+				return -1;
+			done += rc;
+		}
+		ctx->bytes += done;
+	}
+	return 0;
+}
+
+static int
+coro_pong_f(void *arg)
+{
+	struct io_ctx *ctx = arg;
+	char buf[64];
+	ssize_t rc;
+	while ((rc = coro_read(ctx->fd, buf, sizeof(buf))) > 0) {
+		ctx->bytes += rc;
+		if (coro_write(ctx->fd, buf, rc) != rc)
+			return -1;
+	}
+	return rc;
+}
+
+static void
+test_io_socketpair(void)
+{
+	unit_test_start();
+
+	coro_sched_init();
+	int count = 100;
+	int fds[2 * count];
+	struct io_ctx ctx[2 * count];
+	for (int i = 0; i < count; ++i) {
+		unit_fail_if(socketpair(AF_UNIX, SOCK_STREAM, 0,
+					&fds[2 * i]) != 0);
+		ctx[2 * i] = (struct io_ctx){fds[2 * i], 0, 100, 0};
+		ctx[2 * i + 1] = (struct io_ctx){fds[2 * i + 1], 0, 0, 0};
+		coro_new(coro_ping_f, &ctx[2 * i]);
+		coro_new(coro_pong_f, &ctx[2 * i + 1]);
+	}
+	struct coro *c;
+	int ok = 0;
+	while ((c = coro_sched_wait()) != NULL) {
+		if (coro_status(c) == 0)
+			++ok;
+		coro_delete(c);
+		/* Let the pongs see EOF. */
+		for (int i = 0; i < count; ++i) {
+			if (ctx[2 * i].bytes == 100 * 64 &&
+			    ctx[2 * i].fd >= 0) {
+				coro_close(ctx[2 * i].fd);
+				ctx[2 * i].fd = -1;
+			}
+		}
+	}
+	unit_check(ok == 2 * count, "all ping-pongs are done");
+	long long bytes = 0;
+	for (int i = 0; i < 2 * count; ++i)
+		bytes += ctx[i].bytes;
+	unit_check(bytes == 2 * count * 100 * 64, "all is transferred");
+	for (int i = 0; i < count; ++i)
+		coro_close(fds[2 * i + 1]);
+	coro_sched_destroy();
+
+	unit_test_finish();
+}
+
+struct accept_ctx {
+	int listen_fd;
+	struct sockaddr_in addr;
+	char msg[16];
+};
+
+static int
+coro_server_f(void *arg)
+{
+	struct accept_ctx *ctx = arg;
+	int fd = coro_accept(ctx->listen_fd, NULL, NULL);
+	if (fd < 0)
+		return -1;
+	ssize_t rc = coro_read(fd, ctx->msg, sizeof(ctx->msg));
+	coro_close(fd);
+	return rc;
+}
+
+static int
+coro_client_f(void *arg)
+{
+	struct accept_ctx *ctx = arg;
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (coro_connect(fd, (struct sockaddr *)&ctx->addr,
+			 sizeof(ctx->addr)) != 0) {
+		coro_close(fd);
+		return -1;
+	}
+	ssize_t rc = coro_write(fd, "hello", 5);
+	coro_close(fd);
+	return rc;
+}
+
+static void
+test_io_accept_connect(void)
+{
+	unit_test_start();
+
+	coro_sched_init();
+	struct accept_ctx ctx;
+	memset(&ctx, 0, sizeof(ctx));
+	ctx.listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+	ctx.addr.sin_family = AF_INET;
+	ctx.addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	socklen_t len = sizeof(ctx.addr);
+	unit_fail_if(bind(ctx.listen_fd, (struct sockaddr *)&ctx.addr,
+			  len) != 0);
+	unit_fail_if(listen(ctx.listen_fd, 16) != 0);
+	unit_fail_if(getsockname(ctx.listen_fd,
+				 (struct sockaddr *)&ctx.addr, &len) != 0);
+	struct coro *server = coro_new(coro_server_f, &ctx);
+	coro_new(coro_client_f, &ctx);
+	struct coro *c;
+	while ((c = coro_sched_wait()) != NULL) {
+		unit_check(coro_status(c) == 5, c == server ? "server" :
+			   "client");
+		coro_delete(c);
+	}
+	unit_check(strcmp(ctx.msg, "hello") == 0, "message is delivered");
+	coro_close(ctx.listen_fd);
+	coro_sched_destroy();
+
+	unit_test_finish();
+}
+
+static void
+test_io_sleep_in_epoll(void)
+{
+	unit_test_start();
+
+	coro_sched_init();
+	int fds[2];
+	unit_fail_if(pipe(fds) != 0);
+	fflush(stdout);
+	pid_t pid = fork();
+	unit_fail_if(pid < 0);
+	if (pid == 0) {
+		usleep(100000);
+		_exit(write(fds[1], "x", 1) != 1);
+	}
+	close(fds[1]);
+	struct io_ctx ctx = {fds[0], 0, 0, 0};
+	struct coro *r = coro_new(coro_reader_f, &ctx);
+	clock_t cpu = clock();
+	unit_check(coro_sched_wait() == r, "reader is woken up by epoll");
+	cpu = clock() - cpu;
+	unit_check(ctx.bytes == 1, "got data from another process");
+	unit_check(cpu < CLOCKS_PER_SEC / 50, "did not spin while waiting");
+	coro_delete(r);
+	coro_close(fds[0]);
+	waitpid(pid, NULL, 0);
+	coro_sched_destroy();
+
+	unit_test_finish();
+}
+
+struct sleep_ctx {
+	uint64_t ns;
+	int *order;
+	int *order_size;
+	int id;
+};
+
+static int
+coro_sleep_f(void *arg)
+{
+	struct sleep_ctx *ctx = arg;
+	uint64_t start = coro_clock_ns();
+	coro_sleep(ctx->ns);
+	ctx->order[(*ctx->order_size)++] = ctx->id;
+	return coro_clock_ns() - start >= ctx->ns;
+}
+
+static int
+coro_close_later_f(void *arg)
+{
+	coro_sleep(40000000);
+	coro_close((int)(long)arg);
+	return 1;
+}
+
+static void
+test_sleep(void)
+{
+	unit_test_start();
+
+	coro_sched_init();
+	/* A reader to make the scheduler wait in epoll. */
+	int fds[2];
+	unit_fail_if(pipe(fds) != 0);
+	struct io_ctx io = {fds[0], 0, 0, 0};
+	coro_new(coro_reader_f, &io);
+	coro_new(coro_close_later_f, (void *)(long)fds[1]);
+	int order[3];
+	int order_size = 0;
+	struct sleep_ctx ctx[3] = {
+		{30000000, order, &order_size, 2},
+		{10000000, order, &order_size, 0},
+		{20000000, order, &order_size, 1},
+	};
+	uint64_t start = coro_clock_ns();
+	clock_t cpu = clock();
+	for (int i = 0; i < 3; ++i)
+		coro_new(coro_sleep_f, &ctx[i]);
+	struct coro *c;
+	int ok = 0;
+	while ((c = coro_sched_wait()) != NULL) {
+		ok += coro_status(c);
+		coro_delete(c);
+	}
+	uint64_t duration = coro_clock_ns() - start;
+	cpu = clock() - cpu;
+	unit_check(ok == 4, "slept not less than asked");
+	unit_check(order[0] == 0 && order[1] == 1 && order[2] == 2,
+		   "woken up in the order of deadlines");
+	unit_check(duration >= 40000000 && duration < 70000000,
+		   "slept in parallel");
+	coro_close(fds[0]);
+	unit_check(cpu < CLOCKS_PER_SEC / 100, "did not spin while sleeping");
+	coro_sched_destroy();
+
+	unit_test_finish();
+}
+
+static int
+coro_suspend_until_f(void *arg)
+{
+	uint64_t timeout = (uint64_t)arg;
+	return coro_suspend_until(coro_clock_ns() + timeout);
+}
+
+static int
+coro_wake_later_f(void *arg)
+{
+	coro_sleep(10000000);
+	coro_wakeup(arg);
+	return 0;
+}
+
+static void
+test_suspend_until(void)
+{
+	unit_test_start();
+
+	coro_sched_init();
+	struct coro *c = coro_new(coro_suspend_until_f, (void *)1000000L);
+	unit_check(coro_sched_wait() == c, "finished");
+	unit_check(coro_status(c) == 0, "timed out");
+	coro_delete(c);
+
+	uint64_t start = coro_clock_ns();
+	c = coro_new(coro_suspend_until_f, (void *)10000000000L);
+	struct coro *waker = coro_new(coro_wake_later_f, c);
+	unit_check(coro_sched_wait() == waker, "waker finished");
+	unit_check(coro_sched_wait() == c, "sleeper finished");
+	unit_check(coro_status(c) == 1, "woken up");
+	unit_check(coro_clock_ns() - start < 1000000000,
+		   "did not wait for the deadline");
+	coro_delete(c);
+	coro_delete(waker);
+
+	/* The sleeper is not starved by the busy yielding ones. */
+	int order[2];
+	int order_size = 0;
+	struct sleep_ctx ctx = {1000000, order, &order_size, 0};
+	c = coro_new(coro_sleep_f, &ctx);
+	struct coro *busy = coro_new(coro_busy_f, (void *)10000000L);
+	unit_check(coro_sched_wait() == c, "sleeper finished first");
+	coro_delete(c);
+	unit_check(coro_sched_wait() == busy, "busy finished");
+	coro_delete(busy);
+	coro_sched_destroy();
+
+	unit_test_finish();
+}
+
+enum {
+	FILE_BLOCK_SIZE = 4096,
+	FILE_BLOCK_COUNT = 16,
+};
+
+struct file_ctx {
+	int fd;
+	int block;
+};
+
+/** Write a block at its offset, read it back, check it. */
+static int
+coro_file_f(void *arg)
+{
+	struct file_ctx *ctx = arg;
+	char buf[FILE_BLOCK_SIZE], check[FILE_BLOCK_SIZE];
+	memset(buf, 'a' + ctx->block, sizeof(buf));
+	off_t offset = (off_t)ctx->block * FILE_BLOCK_SIZE;
+	if (coro_pwrite(ctx->fd, buf, sizeof(buf), offset) != sizeof(buf))
+		return 0;
+	coro_yield();
+	if (coro_pread(ctx->fd, check, sizeof(check), offset) !=
+	    sizeof(check))
+		return 0;
+	return memcmp(buf, check, sizeof(buf)) == 0;
+}
+
+static int
+coro_file_read_all_f(void *arg)
+{
+	int fd = (int)(long)arg;
+	char buf[FILE_BLOCK_SIZE];
+	int block = 0;
+	ssize_t rc;
+	while ((rc = coro_read(fd, buf, sizeof(buf))) == sizeof(buf)) {
+		if (buf[0] != 'a' + block || buf[sizeof(buf) - 1] != buf[0])
+			return 0;
+		++block;
+	}
+	if (rc != 0 || block != FILE_BLOCK_COUNT)
+		return 0;
+	return coro_pread(-1, buf, sizeof(buf), 0) == -1 && errno == EBADF;
+}
+
+static void
+test_file_io(void)
+{
+	unit_test_start();
+
+	/* Io_uring and the offload, with one and many threads. */
+	const char *uring[] = {"1", "0", "1", "0"};
+	const char *threads[] = {"0", "0", "4", "4"};
+	for (int t = 0; t < 4; ++t) {
+		setenv("LIBCORO_IO_URING", uring[t], 1);
+		setenv("LIBCORO_THREADS", threads[t], 1);
+		coro_sched_init();
+		char path[] = "/tmp/libcoro_test_XXXXXX";
+		int fd = mkstemp(path);
+		unit_fail_if(fd < 0);
+		unlink(path);
+		struct file_ctx ctx[FILE_BLOCK_COUNT];
+		for (int i = 0; i < FILE_BLOCK_COUNT; ++i) {
+			ctx[i].fd = fd;
+			ctx[i].block = i;
+			coro_new(coro_file_f, &ctx[i]);
+		}
+		struct coro *c;
+		int ok = 0;
+		while ((c = coro_sched_wait()) != NULL) {
+			ok += coro_status(c);
+			coro_delete(c);
+		}
+		unit_check(ok == FILE_BLOCK_COUNT, "pread and pwrite");
+		coro_new(coro_file_read_all_f, (void *)(long)fd);
+		c = coro_sched_wait();
+		unit_check(coro_status(c) == 1, "read to the end, then error");
+		coro_delete(c);
+		coro_close(fd);
+		coro_sched_destroy();
+	}
+	unsetenv("LIBCORO_IO_URING");
+	unsetenv("LIBCORO_THREADS");
+
+	unit_test_finish();
+}
+
+struct offload_ctx {
+	/** Yields of another coroutine during the blocking call. */
+	int yields;
+	bool is_done;
+	pthread_t thread;
+};
+
+static int
+offload_sleep_f(void *arg)
+{
+	struct offload_ctx *ctx = arg;
+	ctx->thread = pthread_self();
+	usleep(50000);
+	errno = ENOENT;
+	return 42;
+}
+
+static int
+coro_offload_f(void *arg)
+{
+	struct offload_ctx *ctx = arg;
+	pthread_t self = pthread_self();
+	int rc = coro_offload(offload_sleep_f, ctx);
+	int err = errno;
+	ctx->is_done = true;
+	return rc == 42 && err == ENOENT &&
+	       ! pthread_equal(ctx->thread, self) &&
+	       pthread_equal(pthread_self(), self);
+}
+
+static int
+coro_offload_counter_f(void *arg)
+{
+	struct offload_ctx *ctx = arg;
+	while (! ctx->is_done) {
+		++ctx->yields;
+		coro_yield();
+	}
+	return 1;
+}
+
+static void
+test_offload(void)
+{
+	unit_test_start();
+
+	coro_sched_init();
+	struct offload_ctx ctx = {0, false, pthread_self()};
+	struct coro *c = coro_new(coro_offload_f, &ctx);
+	struct coro *counter = coro_new(coro_offload_counter_f, &ctx);
+	unit_check(coro_sched_wait() == c, "blocking call is done");
+	unit_check(coro_status(c) == 1,
+		   "run by a helper, result and errno are returned");
+	unit_check(ctx.yields > 100, "others run meanwhile");
+	unit_check(coro_sched_wait() == counter, "counter finished");
+	coro_delete(c);
+	coro_delete(counter);
+	coro_sched_destroy();
+
+	unit_test_finish();
+}
+
+static int
+offload_nap_f(void *arg)
+{
+	(void)arg;
+	usleep(2000);
+	return 7;
+}
+
+static int
+coro_shared_offload_f(void *arg)
+{
+	(void)arg;
+	int ok = 1;
+	for (int i = 0; i < 3; ++i)
+		ok = ok && coro_offload(offload_nap_f, NULL) == 7;
+	return ok;
+}
+
+static int
+coro_shared_offload_local_f(void *arg)
+{
+	(void)arg;
+	int local = 0;
+	coro_offload(offload_nap_f, &local);
+	return 0;
+}
+
+static void
+test_stack_shared_io(void)
+{
+	unit_test_start();
+
+	struct coro_attr attr;
+	coro_attr_create(&attr);
+	attr.is_stack_shared = true;
+	/* Io_uring and the offload. */
+	const char *uring[] = {"1", "0"};
+	for (int t = 0; t < 2; ++t) {
+		setenv("LIBCORO_IO_URING", uring[t], 1);
+		coro_sched_init();
+		char path[] = "/tmp/libcoro_test_XXXXXX";
+		int fd = mkstemp(path);
+		unit_fail_if(fd < 0);
+		unlink(path);
+		struct file_ctx ctx[FILE_BLOCK_COUNT];
+		for (int i = 0; i < FILE_BLOCK_COUNT; ++i) {
+			ctx[i].fd = fd;
+			ctx[i].block = i;
+			coro_new_ex(coro_file_f, &ctx[i], &attr);
+		}
+		for (int i = 0; i < 8; ++i)
+			coro_new_ex(coro_shared_offload_f, NULL, &attr);
+		/* They take the shared stack while the others wait. */
+		for (int i = 0; i < 4; ++i)
+			coro_new_ex(coro_busy_f, (void *)1000L, &attr);
+		struct coro *c;
+		int ok = 0;
+		while ((c = coro_sched_wait()) != NULL) {
+			ok += coro_status(c);
+			coro_delete(c);
+		}
+		unit_check(ok == FILE_BLOCK_COUNT + 8,
+			   "I/O and offload on shared stacks");
+		coro_close(fd);
+		coro_sched_destroy();
+	}
+	unsetenv("LIBCORO_IO_URING");
+
+	coro_sched_init();
+	struct coro *probe = coro_new_ex(coro_busy_f, (void *)0L, &attr);
+	bool is_supported = coro_is_stack_shared(probe);
+	coro_delete(coro_sched_wait());
+	coro_sched_destroy();
+	if (is_supported) {
+		fflush(stdout);
+		pid_t pid = fork();
+		unit_fail_if(pid < 0);
+		if (pid == 0) {
+			close(STDOUT_FILENO);
+			coro_sched_init();
+			coro_new_ex(coro_shared_offload_local_f, NULL, &attr);
+			coro_sched_wait();
+			_exit(0);
+		}
+		int status;
+		unit_fail_if(waitpid(pid, &status, 0) != pid);
+		unit_check(WIFEXITED(status) && WEXITSTATUS(status) == 255,
+			   "offload of a shared stack local is refused");
+	}
+
+	unit_test_finish();
+}
+
+struct remote_job {
+	struct coro *waiter;
+	int delay_us;
+	int input;
+	int result;
+	bool is_done;
+};
+
+/** A thread, not knowing about the scheduler, does the work. */
+static void *
+remote_worker_f(void *arg)
+{
+	struct remote_job *job = arg;
+	if (job->delay_us > 0)
+		usleep(job->delay_us);
+	job->result = job->input * 2;
+	__atomic_store_n(&job->is_done, true, __ATOMIC_RELEASE);
+	coro_wakeup_remote(job->waiter);
+	return NULL;
+}
+
+static int
+coro_remote_f(void *arg)
+{
+	struct remote_job *job = arg;
+	job->waiter = coro_this();
+	pthread_t thread;
+	if (pthread_create(&thread, NULL, remote_worker_f, job) != 0)
+		return 0;
+	pthread_detach(thread);
+	while (! __atomic_load_n(&job->is_done, __ATOMIC_ACQUIRE))
+		coro_suspend_remote();
+	return job->result == job->input * 2;
+}
+
+static void
+test_wakeup_remote(void)
+{
+	unit_test_start();
+
+	int thread_counts[] = {0, 4};
+	for (int t = 0; t < 2; ++t) {
+		coro_sched_init_mt(thread_counts[t]);
+		enum { JOB_COUNT = 20 };
+		struct remote_job jobs[JOB_COUNT];
+		for (int i = 0; i < JOB_COUNT; ++i) {
+			/* Some are done before the coroutine waits. */
+			jobs[i] = (struct remote_job){.input = i,
+				.delay_us = i % 2 == 0 ? 0 : 2000};
+			coro_new(coro_remote_f, &jobs[i]);
+		}
+		struct coro *c;
+		int done = 0;
+		while ((c = coro_sched_wait()) != NULL) {
+			done += coro_status(c);
+			coro_delete(c);
+		}
+		unit_check(done == JOB_COUNT, "all are woken up remotely");
+		coro_sched_destroy();
+	}
+
+	unit_test_finish();
+}
+
+static void
+busy_loop_ns(uint64_t ns)
+{
+	uint64_t start = coro_clock_ns();
+	while (coro_clock_ns() - start < ns);
+}
+
+static int
+coro_work_f(void *arg)
+{
+	busy_loop_ns((uint64_t)arg);
+	coro_yield();
+	busy_loop_ns((uint64_t)arg);
+	return 0;
+}
+
+static void
+test_run_time(void)
+{
+	unit_test_start();
+
+	coro_sched_init();
+	uint64_t ms = 1000000;
+	struct coro *c1 = coro_new(coro_work_f, (void *)(10 * ms));
+	struct coro *c2 = coro_new(coro_work_f, (void *)(10 * ms));
+	unit_check(coro_sched_wait() == c1, "first finished");
+	unit_check(coro_sched_wait() == c2, "second finished");
+	uint64_t run1 = coro_run_time(c1), run2 = coro_run_time(c2);
+	uint64_t wait1 = coro_wait_time(c1), wait2 = coro_wait_time(c2);
+	/*
+	 * The cycle length is calibrated, so it is not exact. The
+	 * process can be descheduled at any moment, so there are
+	 * only lower bounds: the first one waits for the first
+	 * slice of the second one, and the second one is ready all
+	 * the time the first one runs.
+	 */
+	unit_check(run1 >= 19 * ms, "first run time");
+	unit_check(run2 >= 19 * ms, "second run time");
+	unit_check(wait1 >= 9 * ms, "first wait time");
+	unit_check(wait2 >= run1, "second wait time");
+	/* Nobody was suspended, all the wait was in the ready queue. */
+	unit_check(coro_ready_time(c1) == wait1, "first ready time");
+	unit_check(coro_ready_time(c2) == wait2, "second ready time");
+	unit_check(coro_suspend_count(c1) == 0, "first not suspended");
+	uint64_t max1 = coro_max_run_time(c1);
+	unit_check(max1 >= 9 * ms && max1 <= run1 - 9 * ms,
+		   "first longest run");
+	coro_delete(c1);
+	coro_delete(c2);
+
+	/* Sleep is not a wait for the CPU. */
+	int order[1], order_size = 0;
+	struct sleep_ctx ctx = {10 * ms, order, &order_size, 0};
+	c1 = coro_new(coro_sleep_f, &ctx);
+	unit_check(coro_sched_wait() == c1, "sleeper finished");
+	unit_check(coro_suspend_count(c1) == 1, "sleeper suspended once");
+	unit_check(coro_wait_time(c1) >= 9 * ms, "sleeper wait time");
+	unit_check(coro_ready_time(c1) < ms, "sleeper ready time");
+	unit_check(coro_max_run_time(c1) < ms, "sleeper longest run");
+	coro_delete(c1);
+	coro_sched_destroy();
+
+	unit_test_finish();
+}
+
+/** Run @a arg ns in total, giving up the CPU when it is time. */
+static int
+coro_quantum_f(void *arg)
+{
+	struct coro *self = coro_this();
+	while (coro_run_time(self) < (uint64_t)arg)
+		coro_yield_if_expired();
+	return 0;
+}
+
+static void
+test_yield_if_expired(void)
+{
+	unit_test_start();
+
+	coro_sched_init();
+	uint64_t ms = 1000000;
+	coro_sched_set_target_latency(10 * ms);
+	struct coro *c1 = coro_new(coro_quantum_f, (void *)(50 * ms));
+	struct coro *c2 = coro_new(coro_quantum_f, (void *)(50 * ms));
+	/* Any order, a descheduled process makes a slice longer. */
+	struct coro *first = coro_sched_wait();
+	unit_check(first == c1 || first == c2, "one finished");
+	unit_check(coro_sched_wait() == (first == c1 ? c2 : c1),
+		   "other finished");
+	/*
+	 * 5ms quantum each, ~10 slices of each. A slice can be
+	 * longer, when the process is descheduled, but never
+	 * shorter than the quantum. Only the first one had the
+	 * other to yield to all the time, the second one counts
+	 * each call as a yield when alone.
+	 */
+	long long count = coro_switch_count(first);
+	unit_check(count >= 1 && count <= 11,
+		   "yields when the quantum expires");
+	unit_check(coro_run_time(first) / (count + 1) >= 4 * ms,
+		   "does not yield before that");
+	coro_delete(c1);
+	coro_delete(c2);
+	coro_sched_destroy();
+
+	coro_sched_init();
+	c1 = coro_new(coro_quantum_f, (void *)(5 * ms));
+	coro_new(coro_busy_f, (void *)0L);
+	struct coro *c;
+	while ((c = coro_sched_wait()) != c1)
+		coro_delete(c);
+	unit_check(coro_switch_count(c1) > 1000,
+		   "without target latency it always yields");
+	coro_delete(c1);
+	coro_sched_destroy();
+
+	unit_test_finish();
+}
+
+struct preempt_ctx {
+	/** Spin at most that long. */
+	uint64_t duration;
+	/** Or until preempted that many times. */
+	int preempt_count;
+	bool is_done;
+	int ticks;
+};
+
+/** Spin without yields, only passing the preemption points. */
+static int
+coro_runaway_f(void *arg)
+{
+	struct preempt_ctx *ctx = arg;
+	uint64_t deadline = coro_clock_ns() + ctx->duration;
+	int preempt_count = 0;
+	while (coro_clock_ns() < deadline &&
+	       preempt_count < ctx->preempt_count)
+		preempt_count += coro_preempt_point();
+	__atomic_store_n(&ctx->is_done, true, __ATOMIC_RELAXED);
+	return 0;
+}
+
+static int
+coro_ticker_f(void *arg)
+{
+	struct preempt_ctx *ctx = arg;
+	while (! __atomic_load_n(&ctx->is_done, __ATOMIC_RELAXED)) {
+		__atomic_add_fetch(&ctx->ticks, 1, __ATOMIC_RELAXED);
+		coro_yield();
+	}
+	return 0;
+}
+
+static void
+test_preempt(void)
+{
+	unit_test_start();
+
+	uint64_t ms = 1000000;
+	coro_sched_init();
+	unit_check(! coro_preempt_point(), "no preemption by default");
+	struct preempt_ctx ctx = {10 * ms, 1, false, 0};
+	coro_new(coro_runaway_f, &ctx);
+	coro_new(coro_ticker_f, &ctx);
+	struct coro *c;
+	while ((c = coro_sched_wait()) != NULL)
+		coro_delete(c);
+	unit_check(ctx.ticks == 0, "runaway one is not preempted");
+	unit_check(coro_sched_preempt_count() == 0, "nothing is counted");
+	coro_sched_destroy();
+
+	coro_sched_set_preemption(2 * ms);
+	int thread_counts[] = {0, 2};
+	for (int t = 0; t < 2; ++t) {
+		coro_sched_init_mt(thread_counts[t]);
+		/*
+		 * Runaways occupy all the threads. A wall-clock limit
+		 * alone would give them few slices on a busy host, so
+		 * the limit is the preemption count, and the time is
+		 * only a fuse.
+		 */
+		struct preempt_ctx ctxs[2];
+		for (int i = 0; i < 2; ++i) {
+			ctxs[i] = (struct preempt_ctx){5000 * ms, 10, false, 0};
+			coro_new(coro_runaway_f, &ctxs[i]);
+			coro_new(coro_ticker_f, &ctxs[i]);
+		}
+		while ((c = coro_sched_wait()) != NULL)
+			coro_delete(c);
+		/*
+		 * ~10 slices each, with a margin. The workers share
+		 * the tickers, so with threads one ticker can get all
+		 * the turns.
+		 */
+		int ticks = ctxs[0].ticks + ctxs[1].ticks;
+		if (t == 0) {
+			ticks = ctxs[0].ticks < ctxs[1].ticks ?
+				ctxs[0].ticks : ctxs[1].ticks;
+		}
+		unit_check(ticks >= 5, "others run while runaways spin");
+		unit_check(coro_sched_preempt_count() >= 10,
+			   "preemptions are counted");
+		coro_sched_destroy();
+	}
+	coro_sched_set_preemption(0);
+
+	unit_test_finish();
+}
+
+static int long_slice_count;
+static char long_slice_name[CORO_NAME_MAX];
+static uint64_t long_slice_ns;
+
+static void
+long_slice_hook(struct coro *c, uint64_t run_ns)
+{
+	if (strcmp(coro_name(c), "hog") != 0)
+		return;
+	++long_slice_count;
+	strcpy(long_slice_name, coro_name(c));
+	if (run_ns > long_slice_ns)
+		long_slice_ns = run_ns;
+}
+
+/** Run @a arg ms without a switch, then yield. */
+static int
+coro_hog_f(void *arg)
+{
+	uint64_t deadline = coro_clock_ns() + (uint64_t)(long)arg * 1000000;
+	while (coro_clock_ns() < deadline);
+	coro_yield();
+	return 0;
+}
+
+/** Read what a function has written into an fd. */
+static void
+capture_fd(int fd, void (*f)(void), char *buf, size_t size)
+{
+	char path[] = "/tmp/libcoro_test_XXXXXX";
+	int tmp = mkstemp(path);
+	unlink(path);
+	int saved = dup(fd);
+	fflush(NULL);
+	dup2(tmp, fd);
+	f();
+	fflush(NULL);
+	dup2(saved, fd);
+	close(saved);
+	ssize_t len = pread(tmp, buf, size - 1, 0);
+	buf[len > 0 ? len : 0] = 0;
+	close(tmp);
+}
+
+static void
+run_hog(void)
+{
+	coro_sched_set_long_slice(5 * 1000000, NULL);
+	coro_sched_init();
+	coro_set_name(coro_new(coro_hog_f, (void *)10L), "hog");
+	struct coro *c;
+	while ((c = coro_sched_wait()) != NULL)
+		coro_delete(c);
+	coro_sched_destroy();
+	coro_sched_set_long_slice(0, NULL);
+}
+
+static void
+dump_to_stdout(void)
+{
+	coro_sched_dump(STDOUT_FILENO);
+}
+
+static void
+test_long_slice_dump(void)
+{
+	unit_test_start();
+
+	uint64_t ms = 1000000;
+	coro_sched_set_long_slice(5 * ms, long_slice_hook);
+	coro_sched_init();
+	struct coro *hog = coro_new(coro_hog_f, (void *)20L);
+	coro_set_name(hog, "hog");
+	struct coro *quick = coro_new(coro_busy_f, (void *)100L);
+	coro_set_name(quick, "quick one with a much too long name");
+	unit_check(strlen(coro_name(quick)) == CORO_NAME_MAX - 1,
+		   "long name is cut");
+	unit_check(coro_sched_wait() == hog, "hog finished");
+
+	char buf[4096];
+	capture_fd(STDOUT_FILENO, dump_to_stdout, buf, sizeof(buf));
+	unit_check(strstr(buf, "hog              finished") != NULL,
+		   "dump shows the finished one");
+	unit_check(strstr(buf, "quick one with a much too long  ready") !=
+		   NULL, "dump shows the ready one");
+	coro_delete(hog);
+	unit_check(coro_sched_wait() == quick, "quick one finished");
+	coro_delete(quick);
+	/*
+	 * A preempted process can make more slices long. The cycle
+	 * length is calibrated, so the slice is not exactly 20ms.
+	 */
+	unit_check(long_slice_count >= 1 && strcmp(long_slice_name, "hog") == 0 &&
+		   long_slice_ns >= 19 * ms, "long slice is reported");
+	coro_sched_destroy();
+	coro_sched_set_long_slice(0, NULL);
+
+	capture_fd(STDERR_FILENO, run_hog, buf, sizeof(buf));
+	const char *frames = strstr(buf, "until:\n");
+	int frame_count = 0;
+	if (frames != NULL) {
+		for (const char *p = frames; *p != 0; ++p)
+			frame_count += *p == '\n';
+		/* The header line. */
+		--frame_count;
+	}
+	unit_check(strstr(buf, "'hog' ran") != NULL && frames != NULL,
+		   "default report has a header");
+	/* The hog, the scheduler and the reporter at least. */
+	unit_check(frame_count >= 3 ||
+		   (frame_count == 1 && strstr(frames, "no backtrace") != NULL),
+		   "default report has a backtrace");
+
+	unit_test_finish();
+}
+
+struct chan_ctx {
+	struct coro_chan *ch;
+	int count;
+	long long sum;
+	int is_sorted;
+};
+
+static int
+coro_chan_producer_f(void *arg)
+{
+	struct chan_ctx *ctx = arg;
+	for (int i = 0; i < ctx->count; ++i) {
+		if (coro_chan_send(ctx->ch, &i) != 0)
+			return -1;
+	}
+	return 0;
+}
+
+static int
+coro_chan_consumer_f(void *arg)
+{
+	struct chan_ctx *ctx = arg;
+	int value;
+	int prev = -1;
+	ctx->is_sorted = 1;
+	while (coro_chan_recv(ctx->ch, &value) == 0) {
+		if (value <= prev)
+			ctx->is_sorted = 0;
+		prev = value;
+		ctx->sum += value;
+	}
+	return errno == EPIPE ? 0 : -1;
+}
+
+static int
+coro_chan_closer_f(void *arg)
+{
+	struct chan_ctx *ctx = arg;
+	while (coro_chan_send(ctx->ch, &ctx->count) == 0)
+		++ctx->sum;
+	return errno == EPIPE ? 0 : -1;
+}
+
+static void
+test_chan(void)
+{
+	unit_test_start();
+
+	coro_sched_init();
+	struct chan_ctx ctx = {coro_chan_new(4, sizeof(int)), 1000, 0, 0};
+	struct coro *p = coro_new(coro_chan_producer_f, &ctx);
+	struct coro *c = coro_new(coro_chan_consumer_f, &ctx);
+	unit_check(coro_sched_wait() == p, "producer finished");
+	unit_check(coro_status(p) == 0, "all is sent");
+	unit_check(coro_switch_count(p) >= ctx.count / 5,
+		   "producer waited for free slots");
+	unit_check(coro_sched_wait() == NULL, "consumer waits");
+	coro_chan_close(ctx.ch);
+	unit_check(coro_sched_wait() == c, "consumer finished");
+	unit_check(coro_status(c) == 0, "consumer saw the close");
+	unit_check(ctx.is_sorted, "order is kept");
+	unit_check(ctx.sum == (long long)ctx.count * (ctx.count - 1) / 2,
+		   "all is received");
+	coro_delete(p);
+	coro_delete(c);
+	coro_chan_delete(ctx.ch);
+
+	/* A blocked sender is woken up by the close. */
+	ctx.ch = coro_chan_new(2, sizeof(int));
+	ctx.sum = 0;
+	c = coro_new(coro_chan_closer_f, &ctx);
+	unit_check(coro_sched_wait() == NULL, "sender waits");
+	unit_check(ctx.sum == 2, "channel is full");
+	coro_chan_close(ctx.ch);
+	unit_check(coro_sched_wait() == c && coro_status(c) == 0,
+		   "sender saw the close");
+	coro_delete(c);
+	int value;
+	unit_check(coro_chan_recv(ctx.ch, &value) == 0 && value == 1000,
+		   "elements are kept after close");
+	unit_check(coro_chan_recv(ctx.ch, &value) == 0 &&
+		   coro_chan_recv(ctx.ch, &value) != 0 && errno == EPIPE,
+		   "then receive fails");
+	coro_chan_delete(ctx.ch);
+	coro_sched_destroy();
+
+	unit_test_finish();
+}
+
+static int
+coro_chan_batch_producer_f(void *arg)
+{
+	struct chan_ctx *ctx = arg;
+	int buf[100];
+	int sent = 0;
+	while (sent < ctx->count) {
+		int count = 0;
+		for (; count < 100 && sent + count < ctx->count; ++count)
+			buf[count] = sent + count;
+		int done = 0;
+		while (done < count) {
+			ssize_t rc = coro_chan_send_batch(ctx->ch, buf + done,
+							  count - done);
+			if (rc <= 0)
+				return -1;
+			done += rc;
+		}
+		sent += count;
+	}
+	coro_chan_close(ctx->ch);
+	return 0;
+}
+
+static int
+coro_chan_batch_consumer_f(void *arg)
+{
+	struct chan_ctx *ctx = arg;
+	int buf[64];
+	int prev = -1;
+	ssize_t rc;
+	ctx->is_sorted = 1;
+	while ((rc = coro_chan_recv_batch(ctx->ch, buf, 64)) > 0) {
+		for (ssize_t i = 0; i < rc; ++i) {
+			if (buf[i] <= prev)
+				ctx->is_sorted = 0;
+			prev = buf[i];
+			ctx->sum += buf[i];
+		}
+	}
+	return 0;
+}
+
+static void
+test_chan_batch(void)
+{
+	unit_test_start();
+
+	coro_sched_init();
+	struct chan_ctx ctx = {coro_chan_new(256, sizeof(int)), 100000, 0, 0};
+	struct coro *p = coro_new(coro_chan_batch_producer_f, &ctx);
+	struct coro *c = coro_new(coro_chan_batch_consumer_f, &ctx);
+	unit_check(coro_sched_wait() == p && coro_status(p) == 0,
+		   "producer finished");
+	unit_check(coro_sched_wait() == c, "consumer finished");
+	unit_check(ctx.is_sorted, "order is kept");
+	unit_check(ctx.sum == (long long)ctx.count * (ctx.count - 1) / 2,
+		   "all is received");
+	unit_check(coro_switch_count(p) < ctx.count / 50,
+		   "many elements per switch");
+	coro_delete(p);
+	coro_delete(c);
+	coro_chan_delete(ctx.ch);
+
+	/* Would block on an empty or a full channel otherwise. */
+	struct coro_chan *ch = coro_chan_new(1, sizeof(int));
+	int value = 1;
+	unit_check(coro_chan_recv_batch(ch, &value, 0) == 0,
+		   "empty batch is received right away");
+	unit_check(coro_chan_send_batch(ch, &value, 1) == 1 &&
+		   coro_chan_send_batch(ch, &value, 0) == 0,
+		   "empty batch is sent right away");
+	coro_chan_delete(ch);
+	coro_sched_destroy();
+
+	unit_test_finish();
+}
+
+struct mutex_ctx {
+	struct coro_mutex mutex;
+	int value;
+	int order[8];
+	int order_size;
+	int id;
+};
+
+static int
+coro_mutex_f(void *arg)
+{
+	struct mutex_ctx *ctx = arg;
+	int id = ctx->id++;
+	for (int i = 0; i < 100; ++i) {
+		coro_mutex_lock(&ctx->mutex);
+		if (i == 0 && ctx->order_size < 8)
+			ctx->order[ctx->order_size++] = id;
+		int value = ctx->value;
+		coro_yield();
+		ctx->value = value + 1;
+		coro_mutex_unlock(&ctx->mutex);
+	}
+	return 0;
+}
+
+static void
+test_mutex(void)
+{
+	unit_test_start();
+
+	coro_sched_init();
+	struct mutex_ctx ctx;
+	memset(&ctx, 0, sizeof(ctx));
+	coro_mutex_create(&ctx.mutex);
+	for (int i = 0; i < 8; ++i)
+		coro_new(coro_mutex_f, &ctx);
+	struct coro *c;
+	while ((c = coro_sched_wait()) != NULL)
+		coro_delete(c);
+	unit_check(ctx.value == 800, "critical sections are serialized");
+	int is_fifo = 1;
+	for (int i = 0; i < 8; ++i)
+		is_fifo = is_fifo && ctx.order[i] == i;
+	unit_check(is_fifo, "handed over in the order of waiting");
+	unit_check(ctx.mutex.owner == NULL, "unlocked");
+	coro_sched_destroy();
+
+	unit_test_finish();
+}
+
+struct cond_ctx {
+	struct coro_mutex mutex;
+	struct coro_cond cond;
+	int queue[4];
+	int size;
+	int received;
+	struct coro_wait_group wg;
+};
+
+static int
+coro_cond_consumer_f(void *arg)
+{
+	struct cond_ctx *ctx = arg;
+	coro_mutex_lock(&ctx->mutex);
+	while (true) {
+		while (ctx->size == 0)
+			coro_cond_wait(&ctx->cond, &ctx->mutex);
+		int value = ctx->queue[--ctx->size];
+		if (value < 0)
+			break;
+		++ctx->received;
+	}
+	coro_mutex_unlock(&ctx->mutex);
+	coro_wait_group_done(&ctx->wg);
+	return 0;
+}
+
+static int
+coro_cond_producer_f(void *arg)
+{
+	struct cond_ctx *ctx = arg;
+	for (int i = 0; i < 100; ++i) {
+		coro_mutex_lock(&ctx->mutex);
+		ctx->queue[ctx->size++] = i;
+		coro_cond_signal(&ctx->cond);
+		coro_mutex_unlock(&ctx->mutex);
+		/* Let the consumer take it. */
+		while (ctx->size != 0)
+			coro_yield();
+	}
+	for (int i = 0; i < 3; ++i) {
+		coro_mutex_lock(&ctx->mutex);
+		ctx->queue[ctx->size++] = -1;
+		coro_cond_broadcast(&ctx->cond);
+		coro_mutex_unlock(&ctx->mutex);
+		while (ctx->size != 0)
+			coro_yield();
+	}
+	return 0;
+}
+
+static int
+coro_wait_group_waiter_f(void *arg)
+{
+	struct cond_ctx *ctx = arg;
+	coro_wait_group_wait(&ctx->wg);
+	return ctx->received;
+}
+
+static void
+test_cond_wait_group(void)
+{
+	unit_test_start();
+
+	coro_sched_init();
+	struct cond_ctx ctx;
+	memset(&ctx, 0, sizeof(ctx));
+	coro_mutex_create(&ctx.mutex);
+	coro_cond_create(&ctx.cond);
+	coro_wait_group_create(&ctx.wg);
+	coro_wait_group_add(&ctx.wg, 3);
+	struct coro *w = coro_new(coro_wait_group_waiter_f, &ctx);
+	for (int i = 0; i < 3; ++i)
+		coro_new(coro_cond_consumer_f, &ctx);
+	struct coro *p = coro_new(coro_cond_producer_f, &ctx);
+	struct coro *c;
+	int finished = 0;
+	while ((c = coro_sched_wait()) != NULL) {
+		if (c == w) {
+			unit_check(finished >= 3, "woken up after the group");
+			unit_check(coro_status(w) == 100, "all is received");
+		}
+		++finished;
+		if (c != p)
+			coro_delete(c);
+	}
+	unit_check(finished == 5, "all finished");
+	unit_check(coro_switch_count(p) < 150, "consumers did not spin");
+	coro_delete(p);
+	coro_sched_destroy();
+
+	unit_test_finish();
+}
+
+struct priority_ctx {
+	/** Yields of each coroutine. */
+	int yield_count;
+	/** Yields of the low priority one. */
+	int low_yields;
+	/** Its yields done when the high priority one finished. */
+	int low_yields_at_high_end;
+};
+
+static int
+coro_priority_high_f(void *arg)
+{
+	struct priority_ctx *ctx = arg;
+	for (int i = 0; i < ctx->yield_count; ++i)
+		coro_yield();
+	ctx->low_yields_at_high_end = ctx->low_yields;
+	return 0;
+}
+
+static int
+coro_priority_low_f(void *arg)
+{
+	struct priority_ctx *ctx = arg;
+	for (int i = 0; i < ctx->yield_count; ++i) {
+		++ctx->low_yields;
+		coro_yield();
+	}
+	return 0;
+}
+
+static void
+test_priority(void)
+{
+	unit_test_start();
+
+	coro_sched_init_mt(0);
+	struct coro_attr attr;
+	coro_attr_create(&attr);
+	unit_check(attr.priority == CORO_PRIO_NORMAL, "normal by default");
+	struct priority_ctx ctx = {1000, 0, 0};
+	attr.priority = CORO_PRIO_LOW;
+	struct coro *low = coro_new_ex(coro_priority_low_f, &ctx, &attr);
+	struct coro *high = coro_new(coro_priority_high_f, &ctx);
+	coro_set_priority(high, CORO_PRIO_HIGH);
+	unit_check(coro_sched_wait() == high, "high finished first");
+	unit_check(coro_sched_wait() == low, "low finished");
+	/* High yields to itself, but the low one ages. */
+	int aged = ctx.low_yields_at_high_end;
+	unit_check(aged >= ctx.yield_count / 20 &&
+		   aged <= ctx.yield_count / 5, "low one is not starved");
+	unit_check(coro_switch_count(high) == ctx.yield_count,
+		   "yields are counted");
+	coro_delete(low);
+	coro_delete(high);
+	coro_sched_destroy();
+
+	unit_test_finish();
+}
+
+struct gen_range {
+	int start;
+	int end;
+};
+
+/** Produce every second number in the range. */
+static int
+gen_range_f(void *arg)
+{
+	struct gen_range *r = arg;
+	int count = 0;
+	for (int i = r->start; i < r->end; i += 2, ++count)
+		coro_gen_yield(&i);
+	return count;
+}
+
+/** Merge two sorted generators, as the last step of a sort. */
+static int
+coro_gen_merge_f(void *arg)
+{
+	size_t batch_size = (size_t)arg;
+	struct gen_range even = {0, 1000}, odd = {1, 1000};
+	struct coro_gen *a = coro_gen_new(gen_range_f, &even, sizeof(int),
+					  batch_size);
+	struct coro_gen *b = coro_gen_new(gen_range_f, &odd, sizeof(int),
+					  batch_size);
+	int va, vb, expected = 0;
+	bool has_a = coro_gen_next(a, &va), has_b = coro_gen_next(b, &vb);
+	bool ok = true;
+	while (has_a || has_b) {
+		if (has_a && (! has_b || va <= vb)) {
+			ok = ok && va == expected++;
+			has_a = coro_gen_next(a, &va);
+		} else {
+			ok = ok && vb == expected++;
+			has_b = coro_gen_next(b, &vb);
+		}
+		/* The consumer is a usual coroutine. */
+		coro_yield();
+	}
+	coro_gen_delete(a);
+	coro_gen_delete(b);
+	return ok && expected == 1000;
+}
+
+static void
+test_gen(void)
+{
+	unit_test_start();
+
+	coro_sched_init();
+	for (size_t batch_size = 1; batch_size <= 16; batch_size *= 16) {
+		/* The scheduler context can consume too. */
+		struct gen_range r = {0, 200};
+		struct coro_gen *gen = coro_gen_new(gen_range_f, &r,
+						    sizeof(int), batch_size);
+		int value, count = 0;
+		bool ok = true;
+		while (coro_gen_next(gen, &value))
+			ok = ok && value == 2 * count++;
+		unit_check(ok && count == 100, "all values in order");
+		unit_check(! coro_gen_next(gen, &value), "stays finished");
+		unit_check(coro_gen_status(gen) == 100, "producer result");
+		coro_gen_delete(gen);
+	}
+	coro_sched_destroy();
+
+	int thread_counts[] = {0, 4};
+	for (int t = 0; t < 2; ++t) {
+		coro_sched_init_mt(thread_counts[t]);
+		for (long i = 0; i < 4; ++i)
+			coro_new(coro_gen_merge_f, (void *)(1 + i * 5));
+		struct coro *c;
+		int ok = 0;
+		while ((c = coro_sched_wait()) != NULL) {
+			ok += coro_status(c);
+			coro_delete(c);
+		}
+		unit_check(ok == 4, "lazy merge in coroutines");
+		coro_sched_destroy();
+	}
+
+	unit_test_finish();
+}
+
+struct pt_counter {
+	struct coro_pt pt;
+	int i;
+	int count;
+	/** Where to log the steps, if not NULL. */
+	char *log;
+	int *log_size;
+	char name;
+};
+
+static int
+pt_counter_f(struct coro_pt *pt)
+{
+	struct pt_counter *c = (struct pt_counter *)pt;
+	CORO_PT_BEGIN(pt);
+	for (c->i = 0; c->i < c->count; ++c->i) {
+		if (c->log != NULL)
+			c->log[(*c->log_size)++] = c->name;
+		else
+			__atomic_add_fetch(c->log_size, 1, __ATOMIC_RELAXED);
+		CORO_PT_YIELD(pt);
+	}
+	CORO_PT_END(pt);
+}
+
+static int
+coro_pt_log_f(void *arg)
+{
+	struct pt_counter *c = arg;
+	for (int i = 0; i < c->count; ++i) {
+		c->log[(*c->log_size)++] = c->name;
+		coro_yield();
+	}
+	return 0;
+}
+
+struct pt_waiter {
+	struct coro_pt pt;
+	int wakeups;
+	bool is_done;
+};
+
+static int
+pt_waiter_f(struct coro_pt *pt)
+{
+	struct pt_waiter *w = (struct pt_waiter *)pt;
+	CORO_PT_BEGIN(pt);
+	while (! w->is_done) {
+		CORO_PT_SUSPEND(pt);
+		++w->wakeups;
+	}
+	CORO_PT_END(pt);
+}
+
+static int
+coro_pt_waker_f(void *arg)
+{
+	struct pt_waiter *w = arg;
+	for (int i = 0; i < 3; ++i) {
+		coro_pt_wakeup(&w->pt);
+		coro_yield();
+	}
+	w->is_done = true;
+	/* Before it suspends - the wakeup is not lost. */
+	coro_pt_wakeup(&w->pt);
+	return 0;
+}
+
+static void
+test_pt(void)
+{
+	unit_test_start();
+
+	coro_sched_init_mt(0);
+	char log[16];
+	int log_size = 0;
+	struct pt_counter a = {.count = 3, .log = log, .log_size = &log_size,
+			       .name = 'a'};
+	struct pt_counter b = a, c = a;
+	b.name = 'b';
+	c.name = 'c';
+	coro_pt_start(&a.pt, pt_counter_f);
+	coro_pt_start(&b.pt, pt_counter_f);
+	struct coro *full = coro_new(coro_pt_log_f, &c);
+	unit_check(! coro_pt_is_finished(&a.pt), "not run before wait");
+	unit_check(coro_sched_wait() == full, "stackful finished");
+	unit_check(coro_sched_wait() == NULL, "stackless are not returned");
+	coro_delete(full);
+	log[log_size] = 0;
+	unit_check(strcmp(log, "abcabcabc") == 0, "run in turns");
+	unit_check(coro_pt_is_finished(&a.pt) && coro_pt_is_finished(&b.pt),
+		   "finished");
+
+	struct pt_waiter w = {.wakeups = 0, .is_done = false};
+	coro_pt_start(&w.pt, pt_waiter_f);
+	unit_check(coro_sched_wait() == NULL, "suspended one is not waited");
+	full = coro_new(coro_pt_waker_f, &w);
+	unit_check(coro_sched_wait() == full, "waker finished");
+	unit_check(coro_sched_wait() == NULL, "all done");
+	coro_delete(full);
+	unit_check(w.wakeups == 4 && coro_pt_is_finished(&w.pt),
+		   "woken up");
+	coro_sched_destroy();
+
+	coro_sched_init_mt(4);
+	enum { PT_COUNT = 100 };
+	struct pt_counter pts[PT_COUNT];
+	int steps = 0;
+	for (int i = 0; i < PT_COUNT; ++i) {
+		pts[i] = (struct pt_counter){.count = 1000,
+					     .log_size = &steps};
+		coro_pt_start(&pts[i].pt, pt_counter_f);
+	}
+	unit_check(coro_sched_wait() == NULL, "multi-threaded done");
+	unit_check(steps == PT_COUNT * 1000, "all steps are done");
+	coro_sched_destroy();
+
+	unit_test_finish();
+}
+
+struct pool_ctx {
+	struct coro_pool *pool;
+	int job_count;
+	long long counter;
+	/** Counter value seen by coro_pool_wait(). */
+	long long counter_after_wait;
+};
+
+static int
+pool_job_f(void *arg)
+{
+	struct pool_ctx *ctx = arg;
+	coro_yield();
+	__atomic_add_fetch(&ctx->counter, 1, __ATOMIC_RELAXED);
+	return 0;
+}
+
+static int
+coro_pool_user_f(void *arg)
+{
+	struct pool_ctx *ctx = arg;
+	for (int i = 0; i < ctx->job_count; ++i)
+		coro_pool_submit(ctx->pool, pool_job_f, ctx);
+	coro_pool_wait(ctx->pool);
+	ctx->counter_after_wait = __atomic_load_n(&ctx->counter,
+						  __ATOMIC_RELAXED);
+	coro_pool_close(ctx->pool);
+	return -1;
+}
+
+static void
+test_pool(void)
+{
+	unit_test_start();
+
+	int thread_counts[] = {0, 4};
+	for (int t = 0; t < 2; ++t) {
+		coro_sched_init_mt(thread_counts[t]);
+		int coro_count = 10;
+		struct pool_ctx ctx;
+		ctx.pool = coro_pool_new(coro_count);
+		ctx.job_count = 10000;
+		ctx.counter = 0;
+		ctx.counter_after_wait = 0;
+		coro_new(coro_pool_user_f, &ctx);
+		struct coro *c;
+		int finished = 0, done = 0;
+		while ((c = coro_sched_wait()) != NULL) {
+			if (coro_status(c) >= 0) {
+				++finished;
+				done += coro_status(c);
+			}
+			coro_delete(c);
+		}
+		coro_pool_delete(ctx.pool);
+		unit_check(ctx.counter_after_wait == ctx.job_count,
+			   "wait returns when all jobs are done");
+		unit_check(finished == coro_count, "pool coroutines finished");
+		unit_check(done == ctx.job_count, "they did all the jobs");
+		coro_sched_destroy();
+	}
+
+	unit_test_finish();
+}
+
+static void
+test_pool_main(void)
+{
+	unit_test_start();
+
+	int thread_counts[] = {0, 2};
+	for (int t = 0; t < 2; ++t) {
+		coro_sched_init_mt(thread_counts[t]);
+		struct pool_ctx ctx;
+		ctx.pool = coro_pool_new(4);
+		ctx.counter = 0;
+		bool ok = true;
+		for (int round = 1; round <= 3; ++round) {
+			for (int i = 0; i < 1000; ++i)
+				coro_pool_submit(ctx.pool, pool_job_f, &ctx);
+			coro_pool_wait(ctx.pool);
+			ok = ok && __atomic_load_n(&ctx.counter,
+						   __ATOMIC_RELAXED) ==
+				   round * 1000;
+		}
+		unit_check(ok, "main waits for the jobs");
+		coro_pool_close(ctx.pool);
+		struct coro *c;
+		int done = 0;
+		while ((c = coro_sched_wait()) != NULL) {
+			done += coro_status(c);
+			coro_delete(c);
+		}
+		coro_pool_delete(ctx.pool);
+		unit_check(done == 3000, "pool coroutines finished after close");
+		coro_sched_destroy();
+	}
+
+	unit_test_finish();
+}
+
+static coro_key_t local_keys[CORO_KEY_FAST_COUNT + 2];
+static int local_destroyed = 0;
+
+static void
+local_destroy(void *value)
+{
+	(void)value;
+	__atomic_add_fetch(&local_destroyed, 1, __ATOMIC_RELAXED);
+}
+
+static int
+coro_local_f(void *arg)
+{
+	long id = (long)arg;
+	int key_count = sizeof(local_keys) / sizeof(local_keys[0]);
+	for (int i = 0; i < key_count; ++i) {
+		if (coro_getspecific(local_keys[i]) != NULL)
+			return 0;
+		coro_setspecific(local_keys[i], (void *)(id * 100 + i));
+	}
+	for (int step = 0; step < 100; ++step) {
+		coro_yield();
+		for (int i = 0; i < key_count; ++i) {
+			if (coro_getspecific(local_keys[i]) !=
+			    (void *)(id * 100 + i))
+				return 0;
+		}
+	}
+	return 1;
+}
+
+static void
+test_local(void)
+{
+	unit_test_start();
+
+	int key_count = sizeof(local_keys) / sizeof(local_keys[0]);
+	bool ok = true;
+	for (int i = 0; i < key_count; ++i)
+		ok = ok && coro_key_create(&local_keys[i], local_destroy) == 0;
+	unit_check(ok, "keys are created");
+	unit_check(local_keys[key_count - 1] >= CORO_KEY_FAST_COUNT,
+		   "there are slow keys");
+
+	/* Values stay with the coroutines, even migrating ones. */
+	int thread_counts[] = {0, 4};
+	for (int t = 0; t < 2; ++t) {
+		coro_sched_init_mt(thread_counts[t]);
+		local_destroyed = 0;
+		int coro_count = 10;
+		for (long i = 1; i <= coro_count; ++i)
+			coro_new(coro_local_f, (void *)i);
+		struct coro *c;
+		int finished = 0;
+		while ((c = coro_sched_wait()) != NULL) {
+			finished += coro_status(c);
+			coro_delete(c);
+		}
+		unit_check(finished == coro_count, "values are coroutine-local");
+		unit_check(local_destroyed == coro_count * key_count,
+			   "values are destroyed");
+		coro_sched_destroy();
+	}
+
+	coro_sched_init();
+	coro_setspecific(local_keys[0], &ok);
+	coro_setspecific(local_keys[key_count - 1], &ok);
+	unit_check(coro_getspecific(local_keys[0]) == &ok &&
+		   coro_getspecific(local_keys[key_count - 1]) == &ok,
+		   "scheduler has own values");
+	unit_check(coro_setspecific(CORO_KEY_MAX, NULL) == -1 &&
+		   errno == EINVAL, "invalid key");
+	coro_sched_destroy();
+
+	unit_test_finish();
+}
+
+struct handoff_ctx {
+	int count;
+	int produced;
+	int consumed;
+	/** Times the consumer did not run right after the producer. */
+	int missed;
+	struct coro *consumer;
+};
+
+static int
+coro_handoff_consumer_f(void *arg)
+{
+	struct handoff_ctx *ctx = arg;
+	while (ctx->consumed < ctx->count) {
+		if (ctx->consumed <
+		    __atomic_load_n(&ctx->produced, __ATOMIC_ACQUIRE))
+			__atomic_add_fetch(&ctx->consumed, 1, __ATOMIC_RELEASE);
+		else
+			coro_suspend();
+	}
+	return 0;
+}
+
+static int
+coro_handoff_producer_f(void *arg)
+{
+	struct handoff_ctx *ctx = arg;
+	for (int i = 1; i <= ctx->count; ++i) {
+		__atomic_store_n(&ctx->produced, i, __ATOMIC_RELEASE);
+		coro_wakeup(ctx->consumer);
+		coro_yield_to(ctx->consumer);
+		if (__atomic_load_n(&ctx->consumed, __ATOMIC_ACQUIRE) != i)
+			++ctx->missed;
+	}
+	return 0;
+}
+
+static int
+coro_handoff_noise_f(void *arg)
+{
+	struct handoff_ctx *ctx = arg;
+	while (__atomic_load_n(&ctx->consumed, __ATOMIC_ACQUIRE) < ctx->count)
+		coro_yield();
+	return 0;
+}
+
+static char policy_log[16];
+static int policy_log_size;
+
+static int
+coro_policy_log_f(void *arg)
+{
+	long yield_count = (long)arg;
+	for (long i = 0; i <= yield_count; ++i) {
+		policy_log[policy_log_size++] = '0' + yield_count;
+		coro_yield();
+	}
+	return 0;
+}
+
+/** The one which has run more is more important. */
+static bool
+policy_busy_first(const struct coro *a, const struct coro *b)
+{
+	return coro_switch_count(a) > coro_switch_count(b);
+}
+
+static void
+check_policy_log(enum coro_sched_policy policy, coro_policy_less_f less,
+		 const char *expected, const char *msg)
+{
+	coro_sched_set_policy(policy, less);
+	coro_sched_init();
+	policy_log_size = 0;
+	for (long i = 0; i < 3; ++i)
+		coro_new(coro_policy_log_f, (void *)i);
+	struct coro *c;
+	while ((c = coro_sched_wait()) != NULL)
+		coro_delete(c);
+	coro_sched_destroy();
+	policy_log[policy_log_size] = 0;
+	unit_check(strcmp(policy_log, expected) == 0, msg);
+}
+
+static void
+test_yield_to_policy(void)
+{
+	unit_test_start();
+
+	int thread_counts[] = {0, 4};
+	for (int t = 0; t < 2; ++t) {
+		coro_sched_init_mt(thread_counts[t]);
+		struct handoff_ctx ctx = {10000, 0, 0, 0, NULL};
+		ctx.consumer = coro_new(coro_handoff_consumer_f, &ctx);
+		for (int i = 0; i < 3; ++i)
+			coro_new(coro_handoff_noise_f, &ctx);
+		coro_new(coro_handoff_producer_f, &ctx);
+		struct coro *c;
+		while ((c = coro_sched_wait()) != NULL)
+			coro_delete(c);
+		coro_sched_destroy();
+		unit_check(ctx.consumed == ctx.count, "all is consumed");
+		if (t == 0) {
+			unit_check(ctx.missed == 0,
+				   "consumer runs right after producer");
+		}
+	}
+
+	/*
+	 * The scheduler context runs it first, and gets back when
+	 * one finishes: the target yields to the other, the other
+	 * yields back, and the target finishes.
+	 */
+	coro_sched_init();
+	int counters[2] = {0, 0};
+	struct coro *other = coro_new(coro_child_f, &counters[0]);
+	struct coro *target = coro_new(coro_child_f, &counters[1]);
+	coro_yield_to(target);
+	unit_check(counters[1] == 1 && counters[0] == 0,
+		   "scheduler runs it first");
+	unit_check(coro_sched_wait() == target, "finished one is returned");
+	unit_check(coro_sched_wait() == other, "other one runs after");
+	coro_delete(target);
+	coro_delete(other);
+	coro_sched_destroy();
+
+	check_policy_log(CORO_POLICY_FIFO, NULL, "012122", "fifo order");
+	check_policy_log(CORO_POLICY_LIFO, NULL, "210212",
+			 "lifo runs new ones first");
+	check_policy_log(CORO_POLICY_CUSTOM, policy_busy_first, "011222",
+			 "custom order");
+	coro_sched_set_policy(CORO_POLICY_FIFO, NULL);
+
+	unit_test_finish();
+}
+
+struct mt_yield_ctx {
+	int yield_count;
+	long long counter;
+};
+
+static int
+coro_mt_yield_f(void *arg)
+{
+	struct mt_yield_ctx *ctx = arg;
+	for (int i = 0; i < ctx->yield_count; ++i) {
+		__atomic_add_fetch(&ctx->counter, 1, __ATOMIC_RELAXED);
+		coro_yield();
+	}
+	return 1;
+}
+
+static void
+test_mt_yield(void)
+{
+	unit_test_start();
+
+	coro_sched_init_mt(4);
+	struct mt_yield_ctx ctx = {1000, 0};
+	int coro_count = 100;
+	for (int i = 0; i < coro_count; ++i)
+		coro_new(coro_mt_yield_f, &ctx);
+	struct coro *c;
+	int finished = 0;
+	long long switches = 0;
+	while ((c = coro_sched_wait()) != NULL) {
+		finished += coro_status(c);
+		switches += coro_switch_count(c);
+		coro_delete(c);
+	}
+	unit_check(finished == coro_count, "all finished");
+	unit_check(ctx.counter == (long long)coro_count * ctx.yield_count,
+		   "all the work is done");
+	unit_check(switches == (long long)coro_count * ctx.yield_count,
+		   "switches are counted");
+	coro_sched_destroy();
+
+	unit_test_finish();
+}
+
+struct mt_migrate_ctx {
+	int step_count;
+	int is_suspended;
+	pthread_t threads[20];
+};
+
+/**
+ * pthread_self() is declared const, so the compiler can call it
+ * once for the whole loop, switches or not. A call via a volatile
+ * pointer can't be cached.
+ */
+static pthread_t (*volatile current_thread)(void) = pthread_self;
+
+static int
+coro_mt_migrate_f(void *arg)
+{
+	struct mt_migrate_ctx *ctx = arg;
+	for (int i = 0; i < ctx->step_count; ++i) {
+		ctx->threads[i] = current_thread();
+		__atomic_store_n(&ctx->is_suspended, 1, __ATOMIC_SEQ_CST);
+		coro_suspend();
+	}
+	return 0;
+}
+
+static void
+test_mt_migrate(void)
+{
+	unit_test_start();
+
+	coro_sched_init_mt(2);
+	struct mt_migrate_ctx ctx;
+	ctx.step_count = 20;
+	ctx.is_suspended = 0;
+	struct coro *c = coro_new(coro_mt_migrate_f, &ctx);
+	for (int i = 0; i < ctx.step_count; ++i) {
+		while (! __atomic_load_n(&ctx.is_suspended, __ATOMIC_SEQ_CST))
+			usleep(100);
+		/* Let it suspend for real. */
+		usleep(1000);
+		__atomic_store_n(&ctx.is_suspended, 0, __ATOMIC_SEQ_CST);
+		coro_wakeup(c);
+	}
+	unit_check(coro_sched_wait() == c, "finished");
+	int migration_count = 0;
+	for (int i = 1; i < ctx.step_count; ++i) {
+		if (! pthread_equal(ctx.threads[i], ctx.threads[i - 1]))
+			++migration_count;
+	}
+	unit_check(migration_count > 0, "resumed in another thread");
+	coro_delete(c);
+
+	c = coro_new(coro_suspend_self_f, &(int){0});
+	unit_check(coro_sched_wait() == NULL,
+		   "nothing to run when all are suspended");
+	coro_wakeup(c);
+	unit_check(coro_sched_wait() == c, "woken up from outside");
+	coro_delete(c);
+	coro_sched_destroy();
+
+	unit_test_finish();
+}
+
+static int
+coro_mt_waiter_f(void *arg)
+{
+	struct wait_ctx *ctx = arg;
+	coro_sched_lock();
+	while (ctx->value == 0)
+		coro_wait_queue_wait(&ctx->wq);
+	coro_sched_unlock();
+	__atomic_add_fetch(&ctx->done, 1, __ATOMIC_RELAXED);
+	return 0;
+}
+
+static int
+coro_mt_notifier_f(void *arg)
+{
+	struct wait_ctx *ctx = arg;
+	coro_sleep(10000000);
+	coro_sched_lock();
+	ctx->value = 1;
+	coro_wait_queue_wakeup_all(&ctx->wq);
+	coro_sched_unlock();
+	return 0;
+}
+
+static void
+test_mt_wait_queue(void)
+{
+	unit_test_start();
+
+	coro_sched_init_mt(4);
+	struct wait_ctx ctx;
+	coro_wait_queue_create(&ctx.wq);
+	ctx.value = 0;
+	ctx.done = 0;
+	int waiter_count = 1000;
+	for (int i = 0; i < waiter_count; ++i)
+		coro_new(coro_mt_waiter_f, &ctx);
+	coro_new(coro_mt_notifier_f, &ctx);
+	struct coro *c;
+	int finished = 0;
+	while ((c = coro_sched_wait()) != NULL) {
+		++finished;
+		coro_delete(c);
+	}
+	unit_check(finished == waiter_count + 1, "all finished");
+	unit_check(ctx.done == waiter_count, "no wakeup is lost");
+	coro_sched_destroy();
+
+	unit_test_finish();
+}
+
+static void
+test_mt_io(void)
+{
+	unit_test_start();
+
+	coro_sched_init_mt(4);
+	int fds[2];
+	unit_fail_if(pipe(fds) != 0);
+	struct io_ctx rctx = {fds[0], 0, 0, 0};
+	struct io_ctx wctx = {fds[1], 1024 * 1024, 4, 0};
+	struct coro *r = coro_new(coro_reader_f, &rctx);
+	struct coro *w = coro_new(coro_writer_f, &wctx);
+	struct coro *c1 = coro_sched_wait();
+	struct coro *c2 = coro_sched_wait();
+	unit_check((c1 == r && c2 == w) || (c1 == w && c2 == r),
+		   "both finished");
+	unit_check(coro_status(r) == 0, "reader got EOF");
+	unit_check(wctx.bytes == 4 * 1024 * 1024 && rctx.bytes == wctx.bytes,
+		   "all is transferred");
+	coro_delete(r);
+	coro_delete(w);
+	coro_close(fds[0]);
+	coro_sched_destroy();
+
+	unit_test_finish();
+}
+
+static void
+test_mt_chan(void)
+{
+	unit_test_start();
+
+	coro_sched_init_mt(4);
+	int pair_count = 8;
+	struct coro_chan *ch = coro_chan_new(16, sizeof(int));
+	struct chan_ctx ctx[pair_count];
+	for (int i = 0; i < pair_count; ++i) {
+		ctx[i] = (struct chan_ctx){ch, 10000, 0, 0};
+		coro_new(coro_chan_producer_f, &ctx[i]);
+		coro_new(coro_chan_consumer_f, &ctx[i]);
+	}
+	struct coro *c;
+	int finished = 0;
+	while (finished < pair_count && (c = coro_sched_wait()) != NULL) {
+		/* Consumers don't finish until the close. */
+		++finished;
+		coro_delete(c);
+	}
+	coro_chan_close(ch);
+	while ((c = coro_sched_wait()) != NULL) {
+		++finished;
+		coro_delete(c);
+	}
+	long long sum = 0;
+	for (int i = 0; i < pair_count; ++i)
+		sum += ctx[i].sum;
+	unit_check(finished == 2 * pair_count, "all finished");
+	unit_check(sum == pair_count * 10000LL * 9999 / 2,
+		   "each element is received once");
+	coro_chan_delete(ch);
+	coro_sched_destroy();
+
+	unit_test_finish();
+}
+
+struct mt_mutex_ctx {
+	struct coro_mutex mutex;
+	struct coro_wait_group wg;
+	long long value;
+};
+
+static int
+coro_mt_mutex_f(void *arg)
+{
+	struct mt_mutex_ctx *ctx = arg;
+	for (int i = 0; i < 1000; ++i) {
+		coro_mutex_lock(&ctx->mutex);
+		long long value = ctx->value;
+		if (i % 10 == 0)
+			coro_yield();
+		ctx->value = value + 1;
+		coro_mutex_unlock(&ctx->mutex);
+	}
+	coro_wait_group_done(&ctx->wg);
+	return 0;
+}
+
+static int
+coro_mt_group_f(void *arg)
+{
+	struct mt_mutex_ctx *ctx = arg;
+	coro_wait_group_wait(&ctx->wg);
+	return ctx->value == 100 * 1000;
+}
+
+static void
+test_mt_mutex(void)
+{
+	unit_test_start();
+
+	coro_sched_init_mt(4);
+	struct mt_mutex_ctx ctx;
+	coro_mutex_create(&ctx.mutex);
+	coro_wait_group_create(&ctx.wg);
+	ctx.value = 0;
+	coro_wait_group_add(&ctx.wg, 100);
+	struct coro *g = coro_new(coro_mt_group_f, &ctx);
+	for (int i = 0; i < 100; ++i)
+		coro_new(coro_mt_mutex_f, &ctx);
+	struct coro *c;
+	while ((c = coro_sched_wait()) != NULL) {
+		if (c != g)
+			coro_delete(c);
+	}
+	unit_check(ctx.value == 100 * 1000, "critical sections are serialized");
+	unit_check(coro_status(g) == 1, "the group is waited for");
+	coro_delete(g);
+	coro_sched_destroy();
+
+	unit_test_finish();
+}
+
+static int
+coro_sleep_done_f(void *arg)
+{
+	struct mt_mutex_ctx *ctx = arg;
+	coro_sleep(2 * 1000 * 1000);
+	coro_wait_group_done(&ctx->wg);
+	return 0;
+}
+
+static int
+coro_suspend_forever_f(void *arg)
+{
+	(void)arg;
+	coro_suspend();
+	return 0;
+}
+
+static void
+test_wait_group_main(void)
+{
+	unit_test_start();
+
+	int thread_counts[] = {0, 2};
+	for (int t = 0; t < 2; ++t) {
+		coro_sched_init_mt(thread_counts[t]);
+		struct mt_mutex_ctx ctx;
+		coro_mutex_create(&ctx.mutex);
+		coro_wait_group_create(&ctx.wg);
+		ctx.value = 0;
+		coro_wait_group_add(&ctx.wg, 11);
+		for (int i = 0; i < 10; ++i)
+			coro_new(coro_mt_mutex_f, &ctx);
+		coro_new(coro_sleep_done_f, &ctx);
+		coro_wait_group_wait(&ctx.wg);
+		unit_check(ctx.value == 10 * 1000 && ctx.wg.count == 0,
+			   "main drives the scheduler until the group is done");
+		int finished = 0;
+		struct coro *c;
+		while ((c = coro_sched_wait()) != NULL) {
+			++finished;
+			coro_delete(c);
+		}
+		unit_check(finished == 11, "the finished ones are kept");
+		coro_sched_destroy();
+	}
+
+	fflush(stdout);
+	pid_t pid = fork();
+	unit_fail_if(pid < 0);
+	if (pid == 0) {
+		close(STDOUT_FILENO);
+		coro_sched_init();
+		struct coro_wait_group wg;
+		coro_wait_group_create(&wg);
+		coro_wait_group_add(&wg, 1);
+		coro_new(coro_suspend_forever_f, NULL);
+		coro_wait_group_wait(&wg);
+		_exit(0);
+	}
+	int status;
+	unit_fail_if(waitpid(pid, &status, 0) != pid);
+	unit_check(WIFEXITED(status) && WEXITSTATUS(status) == 255,
+		   "waiting for nothing is a critical error");
+
+	unit_test_finish();
+}
+
+int
+main(void)
+{
+	test_basic();
+	test_yield();
+	test_yield_sched();
+	test_nested_new();
+	test_stack_pool();
+	test_stack_size();
+	test_stack_overflow();
+	test_stack_used();
+	test_stack_shared();
+	test_suspend();
+	test_wakeup_pending();
+	test_io_pipe();
+	test_io_socketpair();
+	test_io_accept_connect();
+	test_io_sleep_in_epoll();
+	test_sleep();
+	test_file_io();
+	test_offload();
+	test_stack_shared_io();
+	test_wakeup_remote();
+	test_suspend_until();
+	test_run_time();
+	test_yield_if_expired();
+	test_preempt();
+	test_long_slice_dump();
+	test_chan();
+	test_chan_batch();
+	test_mutex();
+	test_cond_wait_group();
+	test_priority();
+	test_pool();
+	test_pool_main();
+	test_gen();
+	test_pt();
+	test_local();
+	test_yield_to_policy();
+	test_mt_yield();
+	test_mt_migrate();
+	test_mt_wait_queue();
+	test_mt_io();
+	test_mt_chan();
+	test_mt_mutex();
+	test_wait_group_main();
+	return 0;
+}
@@ -12,11 +12,6 @@ struct my_context {
 	char *inputFile;
 	int **array;
 	int *size;
-	int sec_start;
-	int nsec_start;
-	int sec_finish;
-	int nsec_finish;
-	double time;
 };
 
 static struct my_context *
@@ -26,7 +21,6 @@ my_context_new(const char *name, char *inputFile, int** array_p, int* size_p) {
 	ctx->inputFile = inputFile;
 	ctx->array = array_p;
 	ctx->size = size_p;
-	ctx->time = 0;
 	return ctx;
 }
 
@@ -56,25 +50,13 @@ static int partition(int arr[], int low, int high) {
 	return (i + 1);
 }
 
-static void quickSort(int arr[], int low, int high, struct my_context *ctx) {
+static void quickSort(int arr[], int low, int high) {
     if (low < high) {
 		int pivotIndex = partition(arr, low, high);
-		quickSort(arr, low, pivotIndex - 1, ctx);
-		quickSort(arr, pivotIndex + 1, high, ctx);
-
-		struct timespec now;
-		clock_gettime(CLOCK_MONOTONIC, &now);
-		ctx->sec_finish = now.tv_sec;
-		ctx->nsec_finish = now.tv_nsec;
-
-		ctx->time += (ctx->sec_finish - ctx->sec_start) * 1e3; //to ms
-		ctx->time += (ctx->nsec_finish - ctx->nsec_start) * 1e-6; //to ms
+		quickSort(arr, low, pivotIndex - 1);
+		quickSort(arr, pivotIndex + 1, high);
 
 		coro_yield();
-
-		clock_gettime(CLOCK_MONOTONIC, &now);
-		ctx->sec_start = now.tv_sec;
-		ctx->nsec_start = now.tv_nsec;
     }
 }
 
@@ -84,11 +66,6 @@ coroutine_func_f(void *context) {
 	struct coro *this = coro_this();
 	struct my_context *ctx = context;
 
-	struct timespec start, finish;
-	clock_gettime(CLOCK_MONOTONIC, &start);
-	ctx->sec_start = start.tv_sec;
-	ctx->nsec_start = start.tv_nsec;
-
 	FILE *file = fopen(ctx->inputFile, "r");
 	if (file == NULL) {
 		printf("Error opening file");
@@ -109,15 +86,10 @@ coroutine_func_f(void *context) {
 		(*ctx->size)++;
 	}
 	
-	quickSort(*ctx->array, 0, *ctx->size - 1, ctx);
+	quickSort(*ctx->array, 0, *ctx->size - 1);
 	fclose(file);
 
-	clock_gettime(CLOCK_MONOTONIC, &finish);
-
-	ctx->time += (finish.tv_sec - ctx->sec_start) * 1e3; //to ms
-	ctx->time += (finish.tv_nsec - ctx->nsec_start) * 1e-6; // to ms
-
-	printf("%s: switch count %lld, work time: %f ms\n", ctx->name, coro_switch_count(this), ctx->time);
+	printf("%s: switch count %lld, work time: %f ms\n", ctx->name, coro_switch_count(this), coro_run_time(this) * 1e-6);
 
 	my_context_delete(ctx);
 	return 0;
@@ -152,6 +124,7 @@ main(int argc, char **argv) {
 	while ((c = coro_sched_wait()) != NULL){
 		coro_delete(c);
 	}
+	coro_sched_destroy();
 
 
 	FILE *outputFile = fopen("output.txt", "w");